@@ -25,12 +25,18 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h> // LS
 #include <math.h> // LS
+#include <SDL2/SDL.h> // LS (threads for parallel mixing)
+#include "reverb.h" // LS
+#include "dynamics.h" // LS
 
 #define CM_USE_STB_VORBIS
 #include "cmixer.h"
 #include "ls_mixer.h"
 #define CM_MAX_CB_QUEUE LS_MIXER_NCHANNEL // (LS)
+#define CM_MAX_VOICES LS_MIXER_NCHANNEL // (LS)
+#define CM_MAX_THREADS 16 // (LS) maximum number of mixing worker threads
 
 #define UNUSED(x)         ((void) (x))
 #define CLAMP(x, a, b)    ((x) < (a) ? (a) : (x) > (b) ? (b) : (x))
@@ -43,27 +49,199 @@
 #define FX_FROM_FLOAT(f)  ((f) * FX_UNIT)
 #define FX_LERP(a, b, p)  ((a) + ((((b) - (a)) * (p)) >> FX_BITS))
 
+/* Playhead position and rate are 32.32 fixed point (LS) */
+#define POS_BITS          (32)
+#define POS_UNIT          ((cm_Int64) 1 << POS_BITS)
+#define POS_MASK          (POS_UNIT - 1)
+#define POS_FROM_FLOAT(f) ((cm_Int64) ((f) * POS_UNIT))
+
+/* Interpolation tables (LS) */
+#define PHASE_BITS        (8)
+#define PHASES            (1 << PHASE_BITS)
+#define COEF_BITS         (14)
+#define CUBIC_TAPS        (4)
+
+/* Internal mix buffers hold half a BUFFER_SIZE of frames of up to
+** CM_MAX_OUTPUTS interleaved channels (LS) */
+#define BUS_FRAMES        (BUFFER_SIZE / 2)
+#define BUS_SIZE          (BUS_FRAMES * CM_MAX_OUTPUTS)
+
+/* Mix buffers hold the channels of each submix bus, the master being bus 0,
+** followed by the stereo send bus (LS) */
+#define SEND_SIZE         (BUS_FRAMES * 2)
+#define SEND_OFFSET       (CM_MAX_BUSES * BUS_SIZE)
+#define MIX_SIZE          (SEND_OFFSET + SEND_SIZE)
+#define SEND_REGION       (CM_MAX_BUSES)
+#define BUS_FILTERS       (4)
+
+/* Virtual sources a spread direction is rendered as (LS) */
+#define SPREAD_STEPS      (8)
+
 
 
 
 cm_Source *cb_queue[CM_MAX_CB_QUEUE];
 
 
+/* Table of active (playing) voices (LS). The parameters touched for every
+** frame are kept in separate contiguous arrays, indexed by voice, so walking
+** all voices does not drag each source's PCM buffer through the cache.
+** Voices are removed by moving the last voice into the freed slot. */
+typedef struct {
+  int count;                            /* Number of active voices */
+  cm_Source *src[CM_MAX_VOICES];        /* Source owning the voice */
+  cm_Int16 *ring[CM_MAX_VOICES];        /* Source's raw stereo or mono PCM buffer */
+  int mono[CM_MAX_VOICES];              /* Whether the ring holds mono PCM */
+  int mask[CM_MAX_VOICES];              /* Frames in the ring minus one */
+  cm_Int64 position[CM_MAX_VOICES];     /* Playhead position (fixed point) */
+  cm_Int64 rate[CM_MAX_VOICES];         /* Playback rate (fixed point) */
+  int interp[CM_MAX_VOICES];            /* Interpolation mode */
+  int nspeakers[CM_MAX_VOICES];         /* Number of output channels mixed into */
+  cm_UInt8 speaker[CM_MAX_VOICES][CM_MAX_OUTPUTS]; /* Output channels mixed into */
+  int lgain[CM_MAX_VOICES][CM_MAX_OUTPUTS];        /* Left gain per output channel (fixed point) */
+  int rgain[CM_MAX_VOICES][CM_MAX_OUTPUTS];        /* Right gain per output channel (fixed point) */
+  int send[CM_MAX_VOICES];              /* Gain into the send bus (fixed point) */
+  int bus[CM_MAX_VOICES];               /* Submix bus the voice is mixed into */
+  int end[CM_MAX_VOICES];               /* End index of the play-through */
+  int nextfill[CM_MAX_VOICES];          /* Next frame idx to fill the buffer, in frames of `level` */
+  int level[CM_MAX_VOICES];             /* Mipmap level the ring holds */
+  cm_Biquad iir[CM_MAX_VOICES];         /* IIR coefficients and history */
+  int filtered[CM_MAX_VOICES];          /* Whether the IIR isn't the identity */
+  cm_Biquad air[CM_MAX_VOICES];         /* Air absorption lowpass after the IIR */
+  int absorbed[CM_MAX_VOICES];          /* Whether `air` isn't the identity */
+  void (*kernel[CM_MAX_VOICES])(cm_Int32*, const cm_Int16*, int, cm_Int64, cm_Int64, int, cm_Biquad*); /* Render function, see `select_kernel()` */
+  double time[CM_MAX_VOICES];           /* Time spent on the voice in this block (profiling) */
+  double decode_time[CM_MAX_VOICES];    /* Part of `time` spent in the source's handler */
+} cm_Voices;
+
+
 static struct {
   const char *lasterror;        /* Last error message */
   cm_EventHandler lock;         /* Event handler for lock/unlock events */
   double (*time_function)(void);/* Function that provides a continiously advancing time in seconds (LS) */ 
-  cm_Source *sources;           /* Linked list of active (playing) sources */
-  cm_Int32 buffer[BUFFER_SIZE]; /* Internal master buffer */
+  cm_Voices voices;             /* Table of active (playing) sources */
+  cm_Int32 buffer[MIX_SIZE];    /* Internal master buffer, `bus` interleaved channels per submix bus, then the send bus */
   int samplerate;               /* Master samplerate */
   int gain;                     /* Master gain (fixed point) */
-  // Master-IIR stuff:
-  cm_Int16 xl[2],xr[2],x0l,x0r;
-  cm_Int16 yl[2],yr[2],y0l,y0r;
-  double a1,a2,b0,b1,b2;
+  cm_Biquad iir[CM_MAX_OUTPUTS / 2]; /* Master IIR, one per pair of channels (LS) */
+  int format;                   /* Output sample format (LS) */
+  int channels;                 /* Number of output channels (LS) */
+  int bus;                      /* Number of channels mixed, mono output is mixed as stereo (LS) */
+  double output[BUS_SIZE];      /* Master output before conversion to `format` (LS) */
+  cm_Convolver *convolver;      /* Reverb on the send bus (LS) */
+  cm_Fdn *fdn;                  /* Algorithmic reverb on the send bus or the master (LS) */
+  int fdn_mode;                 /* One of CM_FDN_* (LS) */
+  double fdn_wet;               /* Gain of the algorithmic reverb (LS) */
+  float wet[2][SEND_SIZE];      /* Input and output of the reverbs (LS) */
+  float fx[BUS_SIZE];           /* Submix bus output for its effect (LS) */
+  cm_Limiter *limiter;          /* Look-ahead limiter after the master gain (LS) */
+  cm_UInt64 clock;              /* Frames mixed before the current block (LS) */
+  SDL_atomic_t clock_seq;       /* Odd while `clock` is being advanced (LS) */
 } cmixer;
 
 
+/* Submix buses (LS). Voices are mixed into the buffer of their bus, and each
+** bus is filtered, run through its effect, scaled and added into its parent.
+** A parent is always created before its children, so going through the buses
+** from the last to the first mixes them bottom up. Bus 0 is the master, which
+** has the master IIR and gain. */
+static struct {
+  int count;
+  struct {
+    char name[32];
+    int parent;
+    double gain;
+    int nfilters;                                       /* Length of the filter chain */
+    cm_Biquad iir[BUS_FILTERS][CM_MAX_OUTPUTS / 2];     /* Filter chain, one per pair of channels */
+    cm_BusEffect effect;                                /* Optional effect after the filters */
+    void *udata;
+    int key;                                            /* Bus ducking this one, -1 if none */
+    cm_Compressor duck;
+  } bus[CM_MAX_BUSES];
+} buses;
+
+static void clear_bus_history(int bus);
+
+
+/* Speaker layout for panning by direction (LS). The output channels taking
+** part are sorted by azimuth into a ring. For the arc between each speaker and
+** the next the inverse of the matrix of their unit vectors is precomputed, so
+** the vector base amplitude panning gains of a direction are one 2x2 product.
+** Arcs of half a circle or more can't be spanned by two vectors and are
+** crossfaded by angle instead. */
+static struct {
+  int count;                        /* Number of speakers in the ring */
+  int channel[CM_MAX_OUTPUTS];      /* Output channel of each speaker */
+  double azimuth[CM_MAX_OUTPUTS];   /* Azimuth in radians, ascending */
+  double inverse[CM_MAX_OUTPUTS][4];/* Inverse base of the arc to the next speaker */
+} layout;
+
+
+/* Listener for sources positioned with `cm_set_emitter()` (LS). Written under
+** the lock, read by the audio thread when it updates the emitters. */
+static struct {
+  double position[3];
+  double velocity[3];
+  double right[3], up[3], forward[3]; /* Orthonormal orientation */
+  double speed_of_sound;
+  double doppler_factor;
+  double air_distance;          /* Distance over which air absorption halves the cutoff, 0 = off */
+} listener;
+
+
+/* Polyphase FIR tables for the cubic and sinc interpolators (LS). Row `p`
+** holds the taps for a fractional position of p / PHASES, in COEF_BITS fixed
+** point, starting at the frame `taps/2 - 1` before the playhead. */
+static cm_Int16 cubic_table[PHASES][CUBIC_TAPS];
+static cm_Int16 sinc_table[PHASES][CM_SINC_TAPS];
+
+/* Number of frames each interpolator reads ahead of the playhead */
+static const int interp_reach[] = { 1, CUBIC_TAPS / 2, CM_SINC_TAPS / 2 };
+
+
+/* Worker threads for mixing voices in parallel (LS). During a block every
+** thread, including the audio thread, claims the next unprocessed voice from
+** a shared counter, so expensive voices do not hold up the others. Workers
+** mix into a private buffer which is summed into `cmixer.buffer` at the end. */
+typedef struct {
+  SDL_Thread *thread;
+  int used;                     /* Regions of the buffer written to in this block, one bit per bus and the send bus */
+  cm_Int32 buffer[MIX_SIZE];    /* Private accumulation buffer */
+} cm_Worker;
+
+static struct {
+  int nthreads;                 /* Number of worker threads */
+  int frames;                   /* Length of the current block */
+  int profiling;                /* Whether the block is timed, `prof.enabled` at its start */
+  int quit;                     /* Set to make the workers exit */
+  SDL_atomic_t next;            /* Index of the next voice to be claimed */
+  SDL_sem *start;               /* Posted once per worker for each block */
+  SDL_sem *done;                /* Posted by a worker when it has finished the block */
+  cm_Worker worker[CM_MAX_THREADS];
+} pool;
+
+
+/* Profiling counters (LS). Only the audio thread writes them; `seq` is odd
+** while an update is in progress so readers can take a consistent snapshot
+** without locking. Block times are sorted into a histogram with four bins
+** per octave of nanoseconds for the percentiles. */
+#define PROF_BINS 112
+
+typedef struct {
+  double min, max, sum;         /* Time per block in seconds */
+  int hist[PROF_BINS];
+} cm_ProfCounter;
+
+static struct {
+  int enabled;
+  int reset;                    /* Set to clear the counters before the next update */
+  SDL_atomic_t seq;
+  int blocks;
+  double budget;                /* Sum of the real-time budgets of all blocks */
+  cm_ProfCounter stage[CM_PROF_STAGES];
+} prof;
+
+
 static void dummy_handler(cm_Event *e) {
   UNUSED(e);
 }
@@ -96,32 +274,113 @@ static const char* error(const char *msg) {
 }
 
 
+static void init_iir(cm_Biquad *f) { // (LS)
+  memset(f, 0, sizeof(*f));
+  f->b0 = 1.0;
+}
+
+
+/* (LS) Run one stereo frame through the filter */
+void cm_process_iir(cm_Biquad *f, double x0l, double x0r, double *y0l, double *y0r) {
+  *y0l = f->b0*x0l + f->b1*f->xl[0] + f->b2*f->xl[1] - (f->a1*f->yl[0] + f->a2*f->yl[1]);
+  *y0r = f->b0*x0r + f->b1*f->xr[0] + f->b2*f->xr[1] - (f->a1*f->yr[0] + f->a2*f->yr[1]);
+
+  f->yl[1] = f->yl[0];
+  f->yr[1] = f->yr[0];
+  f->yl[0] = *y0l;
+  f->yr[0] = *y0r;
+  f->xl[1] = f->xl[0];
+  f->xr[1] = f->xr[0];
+  f->xl[0] = x0l;
+  f->xr[0] = x0r;
+}
+
+
+/* (LS) Run one mono frame through the left half of the filter */
+static void process_iir_mono(cm_Biquad *f, double x0, double *y0) {
+  *y0 = f->b0*x0 + f->b1*f->xl[0] + f->b2*f->xl[1] - (f->a1*f->yl[0] + f->a2*f->yl[1]);
+
+  f->yl[1] = f->yl[0];
+  f->yl[0] = *y0;
+  f->xl[1] = f->xl[0];
+  f->xl[0] = x0;
+}
+
+
+static double bessel_i0(double x) { // (LS)
+  double sum = 1.0, term = 1.0;
+  int k;
+  for (k = 1; k < 32; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+
+/* (LS) Quantize a row of taps, keeping the sum at exactly unity gain */
+static void store_taps(cm_Int16 *dst, const double *w, int taps) {
+  double sum = 0.0;
+  int k, isum = 0, center = taps / 2 - 1;
+  for (k = 0; k < taps; k++) {
+    sum += w[k];
+  }
+  for (k = 0; k < taps; k++) {
+    dst[k] = floor(w[k] / sum * (1 << COEF_BITS) + 0.5);
+    isum += dst[k];
+  }
+  dst[center] += (1 << COEF_BITS) - isum;
+}
+
+
+/* (LS) Kaiser windowed sinc taps for a fractional position `t` (unnormalized) */
+static void sinc_row(double *w, int taps, double t, double cutoff) {
+  const double beta = 7.0;    /* Kaiser window shape */
+  double x;
+  int k;
+  for (k = 0; k < taps; k++) {
+    x = k - (taps / 2 - 1) - t;
+    w[k] = x == 0.0 ? cutoff : sin(M_PI * cutoff * x) / (M_PI * x);
+    x = 2.0 * x / taps;
+    w[k] *= x * x < 1.0 ? bessel_i0(beta * sqrt(1.0 - x * x)) / bessel_i0(beta) : 0.0;
+  }
+}
+
+
+static void init_interp_tables(void) { // (LS)
+  double w[CM_SINC_TAPS];
+  double t;
+  int p;
+
+  for (p = 0; p < PHASES; p++) {
+    t = p / (double) PHASES;
+
+    /* Cubic Hermite (Catmull-Rom) */
+    w[0] = ((-0.5 * t + 1.0) * t - 0.5) * t;
+    w[1] = (1.5 * t - 2.5) * t * t + 1.0;
+    w[2] = ((-1.5 * t + 2.0) * t + 0.5) * t;
+    w[3] = (0.5 * t - 0.5) * t * t;
+    store_taps(cubic_table[p], w, CUBIC_TAPS);
+
+    /* Kaiser windowed sinc, cut off at 90% of the source's Nyquist frequency */
+    sinc_row(w, CM_SINC_TAPS, t, 0.9);
+    store_taps(sinc_table[p], w, CM_SINC_TAPS);
+  }
+}
+
+
 void cm_init(int samplerate) {
   cmixer.samplerate = samplerate;
   cmixer.lock = dummy_handler;
-  cmixer.sources = NULL;
+  cmixer.voices.count = 0;
   cmixer.gain = FX_UNIT;
-  
-  // (LS) initialize IIR buffers
-  cmixer.xl[0] = 0;
-  cmixer.xl[1] = 0;
-  cmixer.yl[0] = 0;
-  cmixer.yl[1] = 0;
-  cmixer.xr[0] = 0;
-  cmixer.xr[1] = 0;
-  cmixer.yr[0] = 0;
-  cmixer.yr[1] = 0;
-  cmixer.x0l = 0;
-  cmixer.x0r = 0;
-  cmixer.y0l = 0;
-  cmixer.y0r = 0;
-  
-  // (LS) initialize IIR coefficients
-  cmixer.a1 = 0.0;
-  cmixer.a2 = 0.0;
-  cmixer.b0 = 1.0;
-  cmixer.b1 = 0.0;
-  cmixer.b2 = 0.0; 
+  init_interp_tables();
+  cm_set_format(CM_FORMAT_S16, 2);
+  buses.count = 0;
+  cm_new_bus("master", -1);
+  cm_set_listener(NULL, NULL, NULL, NULL);
+  cm_set_doppler(343.3, 1.0);
+  cm_set_air_absorption(0.0);
 }
 
 
@@ -135,41 +394,378 @@ void cm_set_time_function(double (time_function)(void)) /* (LS) */
 	return;
 }
 
+/* Default speaker azimuths in SDL's channel order (LS) */
+static const double stereo_layout[] = { -30, 30 };
+static const double quad_layout[] = { -45, 45, -135, 135 };
+static const double surround51_layout[] = { -30, 30, 0, CM_SPEAKER_NONE, -110, 110 };
+static const double surround71_layout[] = { -30, 30, 0, CM_SPEAKER_NONE, -150, 150, -90, 90 };
+
+void cm_set_format(int format, int channels) { // (LS)
+  int i;
+  if (channels != 1 && (channels % 2 || channels > CM_MAX_OUTPUTS)) {
+    error("unsupported number of channels");
+    return;
+  }
+  cmixer.format = format;
+  cmixer.channels = channels;
+  cmixer.bus = MAX(channels, 2);
+  for (i = 0; i < cmixer.bus / 2; i++) {
+    init_iir(&cmixer.iir[i]);
+  }
+  for (i = 1; i < buses.count; i++) {
+    clear_bus_history(i);
+  }
+  switch (cmixer.bus) {
+    case 4: cm_set_speakers(quad_layout); break;
+    case 6: cm_set_speakers(surround51_layout); break;
+    case 8: cm_set_speakers(surround71_layout); break;
+    default: cm_set_speakers(stereo_layout); break;
+  }
+}
+
+
+void cm_set_speakers(const double *azimuth) { // (LS)
+  double a, b, ax, ay, bx, by, det;
+  int i, k, n = 0;
+
+  /* Insert the speakers sorted by azimuth, in (-180, 180] degrees */
+  for (i = 0; i < cmixer.bus; i++) {
+    if (azimuth[i] == CM_SPEAKER_NONE) {
+      continue;
+    }
+    a = fmod(azimuth[i], 360.0);
+    a = a > 180.0 ? a - 360.0 : a <= -180.0 ? a + 360.0 : a;
+    a *= M_PI / 180.0;
+    for (k = n; k > 0 && layout.azimuth[k - 1] > a; k--) {
+      layout.azimuth[k] = layout.azimuth[k - 1];
+      layout.channel[k] = layout.channel[k - 1];
+    }
+    layout.azimuth[k] = a;
+    layout.channel[k] = i;
+    n++;
+  }
+  layout.count = n;
+
+  /* Invert the base of each arc, with x pointing right and y to the front */
+  for (i = 0; i < n; i++) {
+    a = layout.azimuth[i];
+    b = i + 1 < n ? layout.azimuth[i + 1] : layout.azimuth[0] + 2.0 * M_PI;
+    ax = sin(a); ay = cos(a);
+    bx = sin(b); by = cos(b);
+    det = ax * by - ay * bx;
+    if (b - a > 1e-6 && b - a < M_PI - 1e-3) {
+      layout.inverse[i][0] =  by / det;
+      layout.inverse[i][1] = -bx / det;
+      layout.inverse[i][2] = -ay / det;
+      layout.inverse[i][3] =  ax / det;
+    } else {
+      memset(layout.inverse[i], 0, sizeof(layout.inverse[i]));
+    }
+  }
+}
+
+
+/* (LS) Pan a direction (in radians) between the two speakers of the arc it
+** lies in. The gains are normalized to constant power. */
+static void pan_direction(double az, int *ch1, int *ch2, double *g1, double *g2) {
+  const double *inv;
+  double a = 0.0, b = 0.0, x = 0.0, norm;
+  int i;
+
+  if (layout.count < 2) {
+    *ch1 = *ch2 = layout.count ? layout.channel[0] : 0;
+    *g1 = layout.count ? 1.0 : 0.0;
+    *g2 = 0.0;
+    return;
+  }
+
+  /* Find the arc, the last one wraps around past 180 degrees */
+  az = fmod(az, 2.0 * M_PI);
+  for (i = 0; i < layout.count; i++) {
+    a = layout.azimuth[i];
+    b = i + 1 < layout.count ? layout.azimuth[i + 1] : layout.azimuth[0] + 2.0 * M_PI;
+    x = az;
+    while (x < a) x += 2.0 * M_PI;
+    if (x < b || i == layout.count - 1) break;
+  }
+  *ch1 = layout.channel[i];
+  *ch2 = layout.channel[(i + 1) % layout.count];
+
+  inv = layout.inverse[i];
+  if (inv[0] != 0.0 || inv[1] != 0.0) {
+    *g1 = inv[0] * sin(x) + inv[1] * cos(x);
+    *g2 = inv[2] * sin(x) + inv[3] * cos(x);
+    *g1 = MAX(*g1, 0.0);
+    *g2 = MAX(*g2, 0.0);
+  } else if (b - a > 1e-6) {
+    *g1 = cos(0.5 * M_PI * (x - a) / (b - a));
+    *g2 = sin(0.5 * M_PI * (x - a) / (b - a));
+  } else {
+    *g1 = 1.0;
+    *g2 = 0.0;
+  }
+  norm = sqrt(*g1 * *g1 + *g2 * *g2);
+  *g1 /= norm;
+  *g2 /= norm;
+}
+
+
+static int frame_size(void) { // (LS)
+  return cmixer.channels * (cmixer.format == CM_FORMAT_S16 ? 2 : 4);
+}
+
+
 void cm_set_master_gain(double gain) {
   cmixer.gain = FX_FROM_FLOAT(gain);
 }
 
 
+static void copy_gains(int v, const cm_Source *src) { // (LS)
+  cm_Voices *vs = &cmixer.voices;
+  int n = src->nspeakers;
+  vs->nspeakers[v] = n;
+  memcpy(vs->speaker[v], src->speaker, n * sizeof(src->speaker[0]));
+  memcpy(vs->lgain[v], src->lgain, n * sizeof(src->lgain[0]));
+  memcpy(vs->rgain[v], src->rgain, n * sizeof(src->rgain[0]));
+  vs->send[v] = src->send;
+  vs->bus[v] = src->bus;
+}
+
+
+static void select_kernel(int v);
+
+static void add_voice(cm_Source *src) {
+  cm_Voices *vs = &cmixer.voices;
+  int v = vs->count++;
+  vs->src[v] = src;
+  vs->ring[v] = src->buffer;
+  vs->mono[v] = src->channels == 1;
+  vs->mask[v] = src->ring - 1;
+  vs->position[v] = src->position;
+  vs->rate[v] = src->rate;
+  vs->interp[v] = src->interp;
+  copy_gains(v, src);
+  vs->end[v] = src->end;
+  vs->nextfill[v] = src->nextfill;
+  vs->level[v] = src->level;
+  vs->iir[v] = src->iir;
+  vs->air[v] = src->air;
+  select_kernel(v);
+  src->voice = v;
+  src->dirty = 0;
+}
+
+
+static void remove_voice(int v) {
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src = vs->src[v];
+  int last = --vs->count;
+
+  /* Park the playback state in the source */
+  src->position = vs->position[v];
+  src->end = vs->end[v];
+  src->nextfill = vs->nextfill[v];
+  src->level = vs->level[v];
+  src->iir = vs->iir[v];
+  src->air = vs->air[v];
+  src->voice = -1;
+
+  /* Swap and pop */
+  if (v != last) {
+    vs->src[v] = vs->src[last];
+    vs->ring[v] = vs->ring[last];
+    vs->mono[v] = vs->mono[last];
+    vs->mask[v] = vs->mask[last];
+    vs->position[v] = vs->position[last];
+    vs->rate[v] = vs->rate[last];
+    vs->interp[v] = vs->interp[last];
+    vs->nspeakers[v] = vs->nspeakers[last];
+    memcpy(vs->speaker[v], vs->speaker[last], sizeof(vs->speaker[v]));
+    memcpy(vs->lgain[v], vs->lgain[last], sizeof(vs->lgain[v]));
+    memcpy(vs->rgain[v], vs->rgain[last], sizeof(vs->rgain[v]));
+    vs->send[v] = vs->send[last];
+    vs->bus[v] = vs->bus[last];
+    vs->end[v] = vs->end[last];
+    vs->nextfill[v] = vs->nextfill[last];
+    vs->level[v] = vs->level[last];
+    vs->iir[v] = vs->iir[last];
+    vs->filtered[v] = vs->filtered[last];
+    vs->air[v] = vs->air[last];
+    vs->absorbed[v] = vs->absorbed[last];
+    vs->kernel[v] = vs->kernel[last];
+    vs->src[v]->voice = v;
+  }
+}
+
+
+/* (LS) Frames until the end of the first play-through and of the ones after
+** it, which are shorter with a loop region. Sources that don't loop play the
+** whole sound */
+static int first_pass(const cm_Source *src) {
+  return src->loop && src->loop_end ? src->loop_end : src->length;
+}
+
+static int next_pass(const cm_Source *src) {
+  return src->loop && src->loop_end ? src->loop_end - src->loop_start : src->length;
+}
+
+
 static void rewind_source(cm_Source *src) {
   cm_Event e;
+  cm_Voices *vs = &cmixer.voices;
+  int v = src->voice;
   e.type = CM_EVENT_REWIND;
   e.udata = src->udata;
   src->handler(&e);
-  src->position = 0;
+  vs->position[v] = 0;
   src->rewind = 0;
-  src->end = src->length;
-  src->nextfill = 0;
+  vs->end[v] = first_pass(src);
+  vs->nextfill[v] = 0;
+  vs->level[v] = 0;
+  select_kernel(v);
+}
+
+
+/* (LS) The buffer is filled in aligned halves, so decoding restarts at the
+** half the seek target is in */
+static void seek_source(cm_Source *src) {
+  cm_Event e;
+  cm_Voices *vs = &cmixer.voices;
+  int v = src->voice;
+  int frame;
+  if (src->loop && src->loop_end && src->seek >= src->loop_end) {
+    src->seek = src->loop_start + (src->seek - src->loop_start) % next_pass(src);
+  }
+  frame = src->seek & ~(src->ring / 2 - 1);
+  e.type = CM_EVENT_SEEK;
+  e.udata = src->udata;
+  e.length = frame;
+  src->handler(&e);
+  vs->position[v] = (cm_Int64) src->seek << POS_BITS;
+  vs->end[v] = first_pass(src);
+  vs->nextfill[v] = frame;
+  vs->level[v] = 0;
+  select_kernel(v);
+  src->seek = -1;
+}
+
+
+/* (LS) Whether the handler can provide `frames` frames right now. A stream
+** can't while its I/O thread decodes after a rewind or seek, or when it has
+** fallen behind */
+static int source_ready(cm_Source *src, int frames) {
+  cm_Event e;
+  e.type = CM_EVENT_READY;
+  e.udata = src->udata;
+  e.length = frames;
+  src->handler(&e);
+  return e.length >= frames;
 }
 
 
-static void fill_source_buffer(cm_Source *src, int offset, int length) {
+static void fill_source_buffer(cm_Source *src, int frame, int frames) {
   cm_Event e;
   e.type = CM_EVENT_SAMPLES;
   e.udata = src->udata;
-  e.buffer = src->buffer + offset;
-  e.length = length;
+  e.buffer = src->buffer + (frame & (src->ring - 1)) * src->channels; // (LS)
+  e.length = frames * src->channels;
   src->handler(&e);
 }
 
+
+/* (LS) Frame of the sound that is played at frame `frame` of the playhead,
+** which keeps counting up through the play-throughs */
+static int unwrap_frame(const cm_Source *src, int frame) {
+  int first = first_pass(src), pass = next_pass(src);
+  return frame < first ? frame : first - pass + (frame - first) % pass;
+}
+
+
+/* (LS) Fill the ring from a mipmap level instead of the handler. Level frame
+** `i` lies on frame `i << level` of the playhead; after a loop wrap the copy's
+** frame nearest to the sound's frame is taken */
+static void fill_from_mipmap(int v, int frame, int frames) {
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src = vs->src[v];
+  int level = vs->level[v], ch = src->channels;
+  int first = first_pass(src), pass = next_pass(src);
+  int step = 1 << level, last = src->mipmap->frames[level - 1] - 1;
+  const cm_Int16 *data = src->mipmap->level[level - 1];
+  int i, c, k, g = unwrap_frame(src, frame * step);
+  for (i = 0; i < frames; i++) {
+    k = CLAMP((g + step / 2) >> level, 0, last);
+    for (c = 0; c < ch; c++) {
+      vs->ring[v][((frame + i) & vs->mask[v]) * ch + c] = data[k * ch + c];
+    }
+    g += step;
+    while (g >= first) {
+      g -= pass;
+    }
+  }
+}
+
+
+static void fill_voice(int v, int frames) { // (LS)
+  cm_Voices *vs = &cmixer.voices;
+  if (vs->level[v]) {
+    fill_from_mipmap(v, vs->nextfill[v], frames);
+  } else {
+    fill_source_buffer(vs->src[v], vs->nextfill[v], frames);
+  }
+  vs->nextfill[v] += frames;
+}
+
+
+/* (LS) Mipmap level for a rate: the lowest one read at no more than 2:1. A
+** voice only drops to the level below once that is 5% clear of 2:1, so
+** Doppler or pitch wobble around the limit doesn't switch back and forth */
+static int mip_level(const cm_Source *src, cm_Int64 rate, int level) {
+  double r = (double) rate / POS_UNIT;
+  int want = 0;
+  if (!src->mipmap) {
+    return 0;
+  }
+  while (want < src->mipmap->levels && r > 2.0) {
+    r *= 0.5;
+    want++;
+  }
+  return want == level - 1 && r > 1.9 ? level : want;
+}
+
+
+/* (LS) Switch a voice to another mipmap level. The ring is refilled around
+** the playhead in frames of the new level, with the history the interpolator
+** reads behind it; going back to the sound itself seeks the handler */
+static void set_level(int v, int level) {
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src = vs->src[v];
+  int reach = interp_reach[vs->interp[v]];
+  int frame = vs->position[v] >> (POS_BITS + level);
+  int back = reach;
+  cm_Event e;
+  vs->level[v] = level;
+  if (level == 0) {
+    back = MIN(back, unwrap_frame(src, frame));
+    e.type = CM_EVENT_SEEK;
+    e.udata = src->udata;
+    e.length = unwrap_frame(src, frame) - back;
+    src->handler(&e);
+  }
+  vs->nextfill[v] = frame - back;
+  while (frame + reach + 2 >= vs->nextfill[v]) {
+    fill_voice(v, src->ring / 2 - (vs->nextfill[v] & (src->ring / 2 - 1)));
+  }
+  select_kernel(v);
+}
+
 static void add_to_cb_queue(cm_Source *src) // LS
 {
 int i;
 //printf("add\n");
     for (i=0;i<CM_MAX_CB_QUEUE;i++)
     {//printf("add %d\n",i);
-	if (cb_queue[i] == NULL)
+	if (SDL_AtomicCASPtr((void**) &cb_queue[i], NULL, src)) // may be called from worker threads
 	{
-	    cb_queue[i] = src;
 		//printf("Added to cb_queue\n");
 	    return;
 	}
@@ -205,236 +801,1043 @@ static void cm_clear_cb_queue()
     return;
 }
 
-static void process_source(cm_Source *src, int len) {
-  int i, n, a, b, p;
-  int frame, count;
-  cm_Int32 *dst = cmixer.buffer;
+static void recalc_source_gains(cm_Source *src);
+
+/* Pick up state changes made to the source since the last block (LS) */
+static void update_voice(int v) {
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src = vs->src[v];
+  int level;
 
   /* Do rewind if flag is set */
   if (src->rewind) {
     rewind_source(src);
   }
 
+  /* Seek after the rewind, so a stopped source can be started anywhere (LS) */
+  if (src->seek >= 0) {
+    seek_source(src);
+  }
+
   /* Don't process if not playing */
   if (src->state != CM_STATE_PLAYING) {
     return;
   }
 
-  /* Process audio */
-  while (len > 0) {
-    /* Get current position frame */
-    frame = src->position >> FX_BITS;
-
-    /* Fill buffer if required */
-    if (frame + 3 >= src->nextfill) {
-      fill_source_buffer(src, (src->nextfill*2) & BUFFER_MASK, BUFFER_SIZE/2);
-      src->nextfill += BUFFER_SIZE / 4;
-    }
-    
-    /* Handle fading (LS) */ 
+  /* Handle fading (LS) */ 
 	if (src->fade)
 	{
 		double teff = 2.0*(cmixer.time_function() - src->fade_t0)/src->fade_T -1.0;
 		if (teff >= 1.0) 
 		{
 			src->fade = 0;
-			cm_set_gain(src, src->gainf);
+			src->gain = src->gainf;
+			recalc_source_gains(src);
 		}
 		else
 		{
 			//printf("teff: %g\n",teff);
-			cm_set_gain(src, (src->gain0-src->gainf)*0.5*(1.0-teff)+src->gainf); // crossfade constant voltage
-			//cm_set_gain(src, (src->gain0-src->gainf)*sqrt(0.5*(1.0-teff))+src->gainf); // crossfade constant power
+			src->gain = (src->gain0-src->gainf)*0.5*(1.0-teff)+src->gainf; // crossfade constant voltage
+			//src->gain = (src->gain0-src->gainf)*sqrt(0.5*(1.0-teff))+src->gainf; // crossfade constant power
+			recalc_source_gains(src);
 		}
 		//printf("gain: %g\n",src->gain);
 		if (src->gain < 0.0 || src->gain > 1.0) exit(EXIT_FAILURE);
 		
 	}
-	
+
+  /* Copy parameters set through the cm_set_*() functions */
+  if (src->dirty) {
+    src->dirty = 0;
+    vs->rate[v] = src->rate;
+    vs->interp[v] = src->interp;
+    copy_gains(v, src);
+    vs->iir[v].a1 = src->iir.a1;
+    vs->iir[v].a2 = src->iir.a2;
+    vs->iir[v].b0 = src->iir.b0;
+    vs->iir[v].b1 = src->iir.b1;
+    vs->iir[v].b2 = src->iir.b2;
+    vs->air[v].a1 = src->air.a1;
+    vs->air[v].a2 = src->air.a2;
+    vs->air[v].b0 = src->air.b0;
+    vs->air[v].b1 = src->air.b1;
+    vs->air[v].b2 = src->air.b2;
+    select_kernel(v);
+  }
+
+  /* Follow the rate to another mipmap level (LS) */
+  level = mip_level(src, vs->rate[v], vs->level[v]);
+  if (level != vs->level[v]) {
+    set_level(v, level);
+  }
+}
+
+/* (LS) Interpolate one stereo frame with a polyphase FIR table */
+static inline void interpolate_fir(const cm_Int16 *ring, int mask, cm_Int64 position, const cm_Int16 *table, int taps, cm_Int16 *x0l, cm_Int16 *x0r) {
+  const cm_Int16 *c = table + ((position & POS_MASK) >> (POS_BITS - PHASE_BITS)) * taps;
+  int n = (position >> POS_BITS) - (taps / 2 - 1);
+  int k, l = 0, r = 0;
+  for (k = 0; k < taps; k++) {
+    l += ring[((n + k) & mask) * 2    ] * c[k];
+    r += ring[((n + k) & mask) * 2 + 1] * c[k];
+  }
+  l >>= COEF_BITS;
+  r >>= COEF_BITS;
+  *x0l = CLAMP(l, -32768, 32767);
+  *x0r = CLAMP(r, -32768, 32767);
+}
+
+/* (LS) Interpolate one mono frame with a polyphase FIR table */
+static inline cm_Int16 interpolate_fir_mono(const cm_Int16 *ring, int mask, cm_Int64 position, const cm_Int16 *table, int taps) {
+  const cm_Int16 *c = table + ((position & POS_MASK) >> (POS_BITS - PHASE_BITS)) * taps;
+  int n = (position >> POS_BITS) - (taps / 2 - 1);
+  int k, x = 0;
+  for (k = 0; k < taps; k++) {
+    x += ring[(n + k) & mask] * c[k];
+  }
+  x >>= COEF_BITS;
+  return CLAMP(x, -32768, 32767);
+}
+
+
+/* (LS) Render kernels. Each voice renders through the one made for its
+** channel count, interpolation and whether it is filtered, so the common
+** case of an unfiltered voice at unity rate is a plain copy out of the ring.
+** Mono voices are filtered with the left half of the biquad. The kernels
+** render `count` frames into `dst` from a ring of `mask` + 1 frames and
+** leave advancing the playhead to the caller. */
+
+#define READ_UNITY(CH)                                                \
+  for (c = 0; c < CH; c++) {                                          \
+    x[c] = ring[((position >> POS_BITS) & mask) * CH + c];            \
+  }
+
+#define READ_LINEAR(CH)                                               \
+  n = position >> POS_BITS;                                           \
+  p = (position & POS_MASK) >> (POS_BITS - FX_BITS);                  \
+  for (c = 0; c < CH; c++) {                                          \
+    x[c] = FX_LERP(ring[((n    ) & mask) * CH + c],                   \
+                   ring[((n + 1) & mask) * CH + c], p);               \
+  }
+
+#define READ_FIR(CH, TABLE, TAPS)                                     \
+  if (CH == 1) {                                                      \
+    x[0] = interpolate_fir_mono(ring, mask, position, TABLE, TAPS);   \
+  } else {                                                            \
+    interpolate_fir(ring, mask, position, TABLE, TAPS, &x[0], &x[1]); \
+  }
+
+#define READ_CUBIC(CH) READ_FIR(CH, cubic_table[0], CUBIC_TAPS)
+#define READ_SINC(CH)  READ_FIR(CH, sinc_table[0], CM_SINC_TAPS)
+
+#define STORE_RAW(CH)                                                 \
+  for (c = 0; c < CH; c++) {                                          \
+    dst[i * CH + c] = x[c];                                           \
+  }
+
+#define STORE_IIR(CH)                                                 \
+  if (CH == 1) {                                                      \
+    process_iir_mono(iir, x[0], &y[0]);                               \
+  } else {                                                            \
+    cm_process_iir(iir, x[0], x[1], &y[0], &y[1]);                    \
+  }                                                                   \
+  for (c = 0; c < CH; c++) {                                          \
+    dst[i * CH + c] = (int) y[c];                                     \
+  }
+
+#define MIX_KERNEL(NAME, CH, READ, STORE)                             \
+  static void NAME(cm_Int32 *dst, const cm_Int16 *ring, int mask,  \
+                   cm_Int64 position, cm_Int64 rate, int count,       \
+                   cm_Biquad *iir) {                                  \
+    int i, c, n, p;                                                   \
+    cm_Int16 x[2];                                                    \
+    double y[2];                                                      \
+    UNUSED(n); UNUSED(p); UNUSED(y); UNUSED(iir);                     \
+    for (i = 0; i < count; i++) {                                     \
+      READ(CH)                                                        \
+      STORE(CH)                                                       \
+      position += rate;                                               \
+    }                                                                 \
+  }
+
+MIX_KERNEL(mix_mono_unity,       1, READ_UNITY,  STORE_RAW)
+MIX_KERNEL(mix_mono_unity_iir,   1, READ_UNITY,  STORE_IIR)
+MIX_KERNEL(mix_mono_linear,      1, READ_LINEAR, STORE_RAW)
+MIX_KERNEL(mix_mono_linear_iir,  1, READ_LINEAR, STORE_IIR)
+MIX_KERNEL(mix_mono_cubic,       1, READ_CUBIC,  STORE_RAW)
+MIX_KERNEL(mix_mono_cubic_iir,   1, READ_CUBIC,  STORE_IIR)
+MIX_KERNEL(mix_mono_sinc,        1, READ_SINC,   STORE_RAW)
+MIX_KERNEL(mix_mono_sinc_iir,    1, READ_SINC,   STORE_IIR)
+MIX_KERNEL(mix_stereo_unity,     2, READ_UNITY,  STORE_RAW)
+MIX_KERNEL(mix_stereo_unity_iir, 2, READ_UNITY,  STORE_IIR)
+MIX_KERNEL(mix_stereo_linear,    2, READ_LINEAR, STORE_RAW)
+MIX_KERNEL(mix_stereo_linear_iir,2, READ_LINEAR, STORE_IIR)
+MIX_KERNEL(mix_stereo_cubic,     2, READ_CUBIC,  STORE_RAW)
+MIX_KERNEL(mix_stereo_cubic_iir, 2, READ_CUBIC,  STORE_IIR)
+MIX_KERNEL(mix_stereo_sinc,      2, READ_SINC,   STORE_RAW)
+MIX_KERNEL(mix_stereo_sinc_iir,  2, READ_SINC,   STORE_IIR)
+
+/* Indexed by [stereo][unity rate or 1 + interpolation][filtered] */
+static void (*const mix_kernels[2][4][2])(cm_Int32*, const cm_Int16*, int, cm_Int64, cm_Int64, int, cm_Biquad*) = {
+  { { mix_mono_unity,   mix_mono_unity_iir   }, { mix_mono_linear,   mix_mono_linear_iir   },
+    { mix_mono_cubic,   mix_mono_cubic_iir   }, { mix_mono_sinc,     mix_mono_sinc_iir     } },
+  { { mix_stereo_unity, mix_stereo_unity_iir }, { mix_stereo_linear, mix_stereo_linear_iir },
+    { mix_stereo_cubic, mix_stereo_cubic_iir }, { mix_stereo_sinc,   mix_stereo_sinc_iir   } }
+};
+
+
+/* (LS) Pick the kernel for the voice's current parameters */
+static void select_kernel(int v) {
+  cm_Voices *vs = &cmixer.voices;
+  const cm_Biquad *f = &vs->iir[v];
+  int mode = vs->rate[v] >> vs->level[v] == POS_UNIT ? 0 : 1 + vs->interp[v];
+  vs->filtered[v] = f->b0 != 1.0 || f->b1 != 0.0 || f->b2 != 0.0 || f->a1 != 0.0 || f->a2 != 0.0;
+  vs->kernel[v] = mix_kernels[!vs->mono[v]][mode][vs->filtered[v]];
+  f = &vs->air[v];
+  vs->absorbed[v] = f->b0 != 1.0 || f->b1 != 0.0 || f->b2 != 0.0 || f->a1 != 0.0 || f->a2 != 0.0;
+}
+
+
+/* (LS) Bring the IIR history up to date after rendering unfiltered frames,
+** which is what the identity filter would have left, so turning the filter
+** on later continues seamlessly */
+static void skip_iir(cm_Biquad *f, const cm_Int32 *dst, int count, int channels) {
+  if (count >= 2) {
+    f->xl[1] = f->yl[1] = dst[(count - 2) * channels];
+    f->xr[1] = f->yr[1] = dst[(count - 2) * channels + channels - 1];
+  } else {
+    f->xl[1] = f->xl[0];
+    f->yl[1] = f->yl[0];
+    f->xr[1] = f->xr[0];
+    f->yr[1] = f->yr[0];
+  }
+  f->xl[0] = f->yl[0] = dst[(count - 1) * channels];
+  f->xr[0] = f->yr[0] = dst[(count - 1) * channels + channels - 1];
+}
+
+/* (LS) Filter rendered frames in place, for the air absorption that follows
+** the source's own filter */
+static void run_iir(cm_Biquad *f, cm_Int32 *dst, int count, int channels) {
+  double y[2];
+  int i;
+  for (i = 0; i < count; i++) {
+    if (channels == 1) {
+      process_iir_mono(f, dst[i], &y[0]);
+      dst[i] = (int) y[0];
+    } else {
+      cm_process_iir(f, dst[i * 2], dst[i * 2 + 1], &y[0], &y[1]);
+      dst[i * 2] = (int) y[0];
+      dst[i * 2 + 1] = (int) y[1];
+    }
+  }
+}
+
+/* (LS) Add a voice's filtered stereo frames to one output channel of the
+** interleaved master buffer, weighting the left and right input. Kept free of
+** branches in the loops so the compiler can vectorize them. */
+static void accumulate(cm_Int32 *dst, const cm_Int32 *src, int frames, int stride, int lgain, int rgain) {
+  int i;
+  if (rgain == 0) {
+    for (i = 0; i < frames; i++) {
+      dst[i * stride] += (src[2 * i] * lgain) >> FX_BITS;
+    }
+  } else if (lgain == 0) {
+    for (i = 0; i < frames; i++) {
+      dst[i * stride] += (src[2 * i + 1] * rgain) >> FX_BITS;
+    }
+  } else {
+    for (i = 0; i < frames; i++) {
+      dst[i * stride] += (src[2 * i] * lgain + src[2 * i + 1] * rgain) >> FX_BITS;
+    }
+  }
+}
+
+/* (LS) The same for mono frames, which are panned only here */
+static void accumulate_mono(cm_Int32 *dst, const cm_Int32 *src, int frames, int stride, int gain) {
+  int i;
+  for (i = 0; i < frames; i++) {
+    dst[i * stride] += (src[i] * gain) >> FX_BITS;
+  }
+}
+
+/* (LS) Apply the crossfade gain to `frames` rendered frames starting at mixer
+** frame `time`. A fading out source is silent after the fade, and a fading in
+** one stops fading */
+static void crossfade(cm_Source *src, cm_Int32 *buf, int frames, int channels, cm_UInt64 time) {
+  int i, c;
+  double x, g;
+  for (i = 0; i < frames; i++, time++) {
+    if (time < src->xfade_start) {
+      g = src->xfade < 0 ? 1.0 : 0.0;
+    } else if (time >= src->xfade_start + src->xfade_len) {
+      g = src->xfade < 0 ? 0.0 : 1.0;
+    } else {
+      x = (time - src->xfade_start + 0.5) / src->xfade_len * M_PI * 0.5;
+      g = src->xfade < 0 ? cos(x) : sin(x);
+    }
+    for (c = 0; c < channels; c++) {
+      buf[i * channels + c] *= g;
+    }
+  }
+  if (src->xfade > 0 && time >= src->xfade_start + src->xfade_len) {
+    src->xfade = 0;
+  }
+}
+
+static void process_source(int v, int frames, cm_Int32 *mix) {
+  int i, n, offset = 0;
+  int frame, count, reach;
+  cm_Int32 rendered[BUFFER_SIZE];
+  cm_Int32 *dst = rendered;
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src = vs->src[v];
+  cm_Int16 *ring = vs->ring[v];
+  cm_Biquad *iir = &vs->iir[v];
+  cm_Int64 position = vs->position[v];
+  cm_Int64 rate = vs->rate[v];
+  int interp = vs->interp[v];
+  int mono = vs->mono[v];
+  int level;
+
+  /* Don't process if not playing */
+  if (src->state != CM_STATE_PLAYING) {
+    return;
+  }
+
+  /* Wait for the scheduled start, which may be inside this block (LS) */
+  if (src->start_time) {
+    if (src->start_time >= cmixer.clock + frames) {
+      return;
+    }
+    if (src->start_time > cmixer.clock) {
+      offset = src->start_time - cmixer.clock;
+      frames -= offset;
+    }
+    src->start_time = 0;
+  }
+
+  /* Frames past the playhead the interpolator needs in the buffer (LS) */
+  reach = interp_reach[interp];
+
+  /* The ring holds frames of the mipmap level, which the playhead is scaled
+  ** down to for reading it (LS) */
+  level = vs->level[v];
+
+  /* Process audio */
+  while (frames > 0) {
+    /* Get current position frame */
+    frame = position >> POS_BITS;
+
+    /* Fill buffer if required, up to the next half of the ring (LS) */
+    if ((frame >> level) + reach + 2 >= vs->nextfill[v]) {
+      n = src->ring / 2 - (vs->nextfill[v] & (src->ring / 2 - 1));
+      /* Hold the playhead until they are buffered, so it stays in step with
+      ** the ring and the rest of the block is silent (LS) */
+      if (!level && !source_ready(src, n)) {
+        break;
+      }
+      if (pool.profiling) {
+        double t0 = cmixer.time_function();
+        fill_voice(v, n);
+        vs->decode_time[v] += cmixer.time_function() - t0;
+      } else {
+        fill_voice(v, n);
+      }
+    }
 
     /* Handle reaching the end of the playthrough */
-    if (frame >= src->end) {
+    if (frame >= vs->end[v]) {
       /* As streams continiously fill the raw buffer in a loop we simply
       ** increment the end idx by one length and continue reading from it for
       ** another play-through */
-      src->end = frame + src->length;
+      vs->end[v] = frame + next_pass(src);
 	  if (src->finished_cb) add_to_cb_queue(src);
       /* Set state and stop processing if we're not set to loop */
       if (!src->loop) {
         src->state = CM_STATE_STOPPED;
-	
-		//if (src->finished_cb) src->should_cb = 1;//(*src->finished_cb)(src->channel); /* if set, call callback funciton(LS) */
         break;
       }
     }
 
     /* Work out how many frames we should process in the loop */
-    n = MIN(src->nextfill - 2, src->end) - frame;
-    count = (n << FX_BITS) / src->rate;
+    n = MIN((vs->nextfill[v] - reach - 1) << level, vs->end[v]) - frame;
+    count = ((cm_Int64) n << POS_BITS) / rate;
     count = MAX(count, 1);
-    count = MIN(count, len / 2);
-    len -= count * 2;
-
-    /* Add audio to master buffer */
-    if (src->rate == FX_UNIT) {
-      /* Add audio to buffer -- basic */
-      n = frame * 2;
-      for (i = 0; i < count; i++) {
-		
-		// (LS) get current sample:
-		src->x0l = src->buffer[(n    ) & BUFFER_MASK];
-		src->x0r = src->buffer[(n + 1) & BUFFER_MASK];
-		
-		// (LS) calculate current output:
-		src->y0l = src->b0*(double)src->x0l + src->b1 * (double)src->xl[0] + src->b2 * (double)src->xl[1] - (src->a1*(double)src->yl[0] + src->a2*(double)src->yl[1]);
-		src->y0r = src->b0*(double)src->x0r + src->b1 * (double)src->xr[0] + src->b2 * (double)src->xr[1] - (src->a1*(double)src->yr[0] + src->a2*(double)src->yr[1]);
-		
-		// (LS) update sample memory:
-		src->yl[1] = src->yl[0];
-		src->yr[1] = src->yr[0];
-		src->yl[0] = src->y0l;
-		src->yr[0] = src->y0r;
-		src->xl[1] = src->xl[0];
-		src->xr[1] = src->xr[0];
-		src->xl[0] = src->x0l;
-		src->xr[0] = src->x0r;
-		
-		// (LS) add to master buffer with gain:
-        dst[0] += (src->y0l * src->lgain) >> FX_BITS;
-        dst[1] += (src->y0r * src->rgain) >> FX_BITS;
-		
-        n += 2;
-        dst += 2;
-      }
-      src->position += count * FX_UNIT;
+    count = MIN(count, frames);
+    frames -= count;
 
+    /* Add audio to master buffer (LS) */
+    vs->kernel[v](dst, ring, vs->mask[v], position >> level, rate >> level, count, iir);
+    if (!vs->filtered[v]) {
+      skip_iir(iir, dst, count, mono ? 1 : 2);
+    }
+    if (vs->absorbed[v]) {
+      run_iir(&vs->air[v], dst, count, mono ? 1 : 2);
     } else {
-      /* Add audio to buffer -- interpolated */
-      for (i = 0; i < count; i++) {
-        n = (src->position >> FX_BITS) * 2;
-        p = src->position & FX_MASK;
-        
-		// (LS) get current left sample:
-		a = src->buffer[(n    ) & BUFFER_MASK];
-        b = src->buffer[(n + 2) & BUFFER_MASK];
-		src->x0l = FX_LERP(a, b, p);
-        
-        n++;
-        
-		// (LS) get current right sample:
-		a = src->buffer[(n    ) & BUFFER_MASK];
-        b = src->buffer[(n + 2) & BUFFER_MASK];
-		src->x0r = FX_LERP(a, b, p);
-        
-		
-		// (LS) calculate current output:
-		src->y0l = src->b0*(double)src->x0l + src->b1 * (double)src->xl[0] + src->b2 * (double)src->xl[1] - (src->a1*(double)src->yl[0] + src->a2*(double)src->yl[1]);
-		src->y0r = src->b0*(double)src->x0r + src->b1 * (double)src->xr[0] + src->b2 * (double)src->xr[1] - (src->a1*(double)src->yr[0] + src->a2*(double)src->yr[1]);
-		
-		// (LS) update sample memory:
-		src->yl[1] = src->yl[0];
-		src->yr[1] = src->yr[0];
-		src->yl[0] = src->y0l;
-		src->yr[0] = src->y0r;
-		src->xl[1] = src->xl[0];
-		src->xr[1] = src->xr[0];
-		src->xl[0] = src->x0l;
-		src->xr[0] = src->x0r;
-		
-		dst[0] += (src->y0l * src->lgain) >> FX_BITS;
-		dst[1] += (src->y0r * src->rgain) >> FX_BITS;
-		
-        src->position += src->rate;
-        dst += 2;
-      }
+      skip_iir(&vs->air[v], dst, count, mono ? 1 : 2);
     }
+    position += count * rate;
+    dst += count * (mono ? 1 : 2);
+  }
+
+  vs->position[v] = position;
+  src->position = position;
+
+  /* Equal-power crossfade with the next or previous source in a queue (LS) */
+  n = (dst - rendered) / (mono ? 1 : 2);
+  if (src->xfade) {
+    crossfade(src, rendered, n, mono ? 1 : 2, cmixer.clock + offset);
+  }
 
+  /* Pan the rendered frames to the output channels of the voice's bus (LS).
+  ** Both gains apply to a mono source, which stands for identical left and
+  ** right input */
+  if (mono) {
+    for (i = 0; i < vs->nspeakers[v]; i++) {
+      accumulate_mono(mix + vs->bus[v] * BUS_SIZE + offset * cmixer.bus + vs->speaker[v][i], rendered, n, cmixer.bus, vs->lgain[v][i] + vs->rgain[v][i]);
+    }
+    if (vs->send[v]) {
+      accumulate_mono(mix + SEND_OFFSET + offset * 2,     rendered, n, 2, vs->send[v]);
+      accumulate_mono(mix + SEND_OFFSET + offset * 2 + 1, rendered, n, 2, vs->send[v]);
+    }
+    return;
+  }
+  for (i = 0; i < vs->nspeakers[v]; i++) {
+    accumulate(mix + vs->bus[v] * BUS_SIZE + offset * cmixer.bus + vs->speaker[v][i], rendered, n, cmixer.bus, vs->lgain[v][i], vs->rgain[v][i]);
+  }
+  if (vs->send[v]) {
+    accumulate(mix + SEND_OFFSET + offset * 2,     rendered, n, 2, vs->send[v], 0);
+    accumulate(mix + SEND_OFFSET + offset * 2 + 1, rendered, n, 2, 0, vs->send[v]);
   }
 }
 
 void cm_set_iir(cm_Source *src, double b0, double b1, double b2, double a1, double a2) // (LS)
 {
-	src->b0 = b0;
-	src->b1 = b1;
-	src->b2 = b2;
-	src->a1 = a1;
-	src->a2 = a2;
+	src->iir.b0 = b0;
+	src->iir.b1 = b1;
+	src->iir.b2 = b2;
+	src->iir.a1 = a1;
+	src->iir.a2 = a2;
+	src->dirty = 1;
 	return;
 }
 
-void cm_process(cm_Int16 *dst, int len) {
-  int i;
-  cm_Source **s;
-
-  /* Process in chunks of BUFFER_SIZE if `len` is larger than BUFFER_SIZE */
-  while (len > BUFFER_SIZE) {
-    cm_process(dst, BUFFER_SIZE);
-    dst += BUFFER_SIZE;
-    len -= BUFFER_SIZE;
+/* Clear a region of a mix buffer the first time it is written to in a block */
+static void use_region(cm_Int32 *dst, int frames, int region, int *used) {
+  if (!(*used & (1 << region))) {
+    if (region == SEND_REGION) {
+      memset(dst + SEND_OFFSET, 0, frames * 2 * sizeof(dst[0]));
+    } else {
+      memset(dst + region * BUS_SIZE, 0, frames * cmixer.bus * sizeof(dst[0]));
+    }
+    *used |= 1 << region;
+  }
+}
+
+/* Claim and mix voices until all voices of the block are taken (LS) */
+static int mix_voices(cm_Int32 *dst, int frames, int *used) {
+  int v, n = 0;
+  while ((v = SDL_AtomicAdd(&pool.next, 1)) < cmixer.voices.count) {
+    if (pool.profiling) {
+      double t0 = cmixer.time_function();
+      cmixer.voices.decode_time[v] = 0.0;
+      update_voice(v);
+      use_region(dst, frames, cmixer.voices.bus[v], used);
+      use_region(dst, frames, SEND_REGION, used);
+      process_source(v, frames, dst);
+      cmixer.voices.time[v] = cmixer.time_function() - t0;
+    } else {
+      update_voice(v);
+      use_region(dst, frames, cmixer.voices.bus[v], used);
+      use_region(dst, frames, SEND_REGION, used);
+      process_source(v, frames, dst);
+    }
+    n++;
+  }
+  return n;
+}
+
+
+static int worker_thread(void *udata) { // (LS)
+  cm_Worker *w = udata;
+  for (;;) {
+    SDL_SemWait(pool.start);
+    if (pool.quit) {
+      break;
+    }
+    mix_voices(w->buffer, pool.frames, &w->used);
+    SDL_SemPost(pool.done);
+  }
+  return 0;
+}
+
+
+static void stop_threads(void) { // (LS)
+  int i;
+  pool.quit = 1;
+  for (i = 0; i < pool.nthreads; i++) {
+    SDL_SemPost(pool.start);
+  }
+  for (i = 0; i < pool.nthreads; i++) {
+    SDL_WaitThread(pool.worker[i].thread, NULL);
+  }
+  SDL_DestroySemaphore(pool.start);
+  SDL_DestroySemaphore(pool.done);
+  pool.nthreads = 0;
+  pool.quit = 0;
+}
+
+
+void cm_set_threads(int n) // (LS)
+{
+  int i;
+  n = CLAMP(n, 0, CM_MAX_THREADS);
+  lock();
+  if (pool.nthreads > 0) {
+    stop_threads();
+  }
+  if (n > 0) {
+    pool.start = SDL_CreateSemaphore(0);
+    pool.done = SDL_CreateSemaphore(0);
+    for (i = 0; i < n; i++) {
+      pool.worker[i].used = 0;
+      pool.worker[i].thread = SDL_CreateThread(worker_thread, "cm_worker", &pool.worker[i]);
+      if (!pool.worker[i].thread) {
+        error("could not create worker thread");
+        break;
+      }
+      pool.nthreads++;
+    }
+  }
+  unlock();
+}
+
+
+static void prof_add(cm_ProfCounter *c, double t) { // (LS)
+  int bin = t > 1e-9 ? 4.0 * log2(t * 1e9) : 0;
+  if (prof.blocks == 0 || t < c->min) c->min = t;
+  if (prof.blocks == 0 || t > c->max) c->max = t;
+  c->sum += t;
+  c->hist[MIN(bin, PROF_BINS - 1)]++;
+}
+
+
+/* (LS) Collect the time spent on each voice in this block */
+static void prof_voices(double *stage) {
+  cm_Voices *vs = &cmixer.voices;
+  int v;
+
+  stage[CM_PROF_DECODE] = 0.0;
+  stage[CM_PROF_MIX] = 0.0;
+  for (v = 0; v < vs->count; v++) {
+    cm_Source *src = vs->src[v];
+    stage[CM_PROF_DECODE] += vs->decode_time[v];
+    stage[CM_PROF_MIX] += vs->time[v] - vs->decode_time[v];
+    src->prof_time += vs->time[v];
+    src->prof_blocks++;
+  }
+}
+
+
+/* (LS) Add the times measured for a block to the counters */
+static void prof_update(int frames, const double *stage) {
+  int i;
+
+  SDL_AtomicAdd(&prof.seq, 1);
+  SDL_MemoryBarrierRelease();
+  if (prof.reset) {
+    memset(prof.stage, 0, sizeof(prof.stage));
+    prof.blocks = 0;
+    prof.budget = 0.0;
+    prof.reset = 0;
+  }
+  for (i = 0; i < CM_PROF_STAGES; i++) {
+    prof_add(&prof.stage[i], stage[i]);
+  }
+  prof.budget += frames / (double) cmixer.samplerate;
+  prof.blocks++;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicAdd(&prof.seq, 1);
+}
+
+
+void cm_set_profiling(int enable) { // (LS)
+  if (enable && !cmixer.time_function) {
+    error("profiling needs a time function");
+    return;
+  }
+  prof.reset = 1;
+  prof.enabled = enable;
+}
+
+
+void cm_reset_stats(void) { // (LS)
+  prof.reset = 1;
+}
+
+
+void cm_get_stats(cm_Stats *stats) { // (LS)
+  cm_ProfCounter stage[CM_PROF_STAGES];
+  int i, k, n, seq, blocks;
+  double budget;
+
+  /* Copy the counters, retrying if the audio thread updated them meanwhile */
+  do {
+    seq = SDL_AtomicGet(&prof.seq);
+    SDL_MemoryBarrierAcquire();
+    memcpy(stage, prof.stage, sizeof(stage));
+    blocks = prof.blocks;
+    budget = prof.budget;
+    SDL_MemoryBarrierAcquire();
+  } while ((seq & 1) || seq != SDL_AtomicGet(&prof.seq));
+
+  memset(stats, 0, sizeof(*stats));
+  stats->blocks = blocks;
+  if (blocks == 0) {
+    return;
+  }
+  stats->load = stage[CM_PROF_BLOCK].sum / budget;
+  for (i = 0; i < CM_PROF_STAGES; i++) {
+    cm_ProfCounter *c = &stage[i];
+    stats->stage[i].min = c->min * 1e6;
+    stats->stage[i].avg = c->sum / blocks * 1e6;
+    stats->stage[i].max = c->max * 1e6;
+    /* Upper edge of the bin holding the 99th percentile */
+    for (k = 0, n = 0; k < PROF_BINS - 1; k++) {
+      n += c->hist[k];
+      if (n >= blocks * 0.99) break;
+    }
+    stats->stage[i].p99 = MIN(pow(2.0, (k + 1) / 4.0) * 1e-3, stats->stage[i].max);
+  }
+}
+
+
+double cm_get_cost(cm_Source *src) { // (LS)
+  return src->prof_blocks ? src->prof_time / src->prof_blocks * 1e6 : 0.0;
+}
+
+
+/* (LS) Convert the master output to the output format, mono output is
+** mixed as stereo and folded down here */
+#define WRITE_OUTPUT(T, CONV)                                   \
+  {                                                             \
+    T *d = dst;                                                 \
+    if (cmixer.channels == 1) {                                 \
+      for (i = 0; i < len; i += 2) {                            \
+        *d++ = CONV(0.5 * (cmixer.output[i] + cmixer.output[i+1])); \
+      }                                                         \
+    } else {                                                    \
+      for (i = 0; i < len; i++) {                               \
+        d[i] = CONV(cmixer.output[i]);                          \
+      }                                                         \
+    }                                                           \
+  }
+
+#define CONV_S16(x) ((cm_Int16) CLAMP(floor(x), -32768.0, 32767.0))
+#define CONV_S32(x) ((cm_Int32) CLAMP(floor((x) * 65536.0), -2147483648.0, 2147483647.0))
+#define CONV_F32(x) ((float) ((x) * (1.0 / 32768.0)))
+
+static void write_output(void *dst, int len) {
+  int i;
+  switch (cmixer.format) {
+    case CM_FORMAT_S16: WRITE_OUTPUT(cm_Int16, CONV_S16); break;
+    case CM_FORMAT_S32: WRITE_OUTPUT(cm_Int32, CONV_S32); break;
+    case CM_FORMAT_F32: WRITE_OUTPUT(float, CONV_F32); break;
+  }
+}
+
+
+static void update_emitters(void); // (LS)
+static void start_queued(int frames);
+static void detach_emitter(cm_Source *src);
+static void mix_bus(int bus, int frames);
+
+void cm_process(void *dst, int frames) {
+  int i, c, v, len, used, nthreads, profiling;
+  double y0l, y0r, gain;
+  double t = 0.0, t0 = 0.0, stage[CM_PROF_STAGES] = { 0 };
+
+  /* Process in chunks of BUS_FRAMES if more frames are requested */
+  while (frames > BUS_FRAMES) {
+    cm_process(dst, BUS_FRAMES);
+    dst = (char*) dst + BUS_FRAMES * frame_size();
+    frames -= BUS_FRAMES;
+  }
+  len = frames * cmixer.bus;
+
+  /* Read once, so enabling profiling mid-block can't leave stages unset (LS) */
+  profiling = prof.enabled;
+  if (profiling) {
+    t0 = cmixer.time_function();
   }
 
   /* Zeroset internal buffer */
-  memset(cmixer.buffer, 0, len * sizeof(cmixer.buffer[0]));
+  for (i = 0; i < buses.count; i++) {
+    memset(cmixer.buffer + i * BUS_SIZE, 0, len * sizeof(cmixer.buffer[0]));
+  }
+  memset(cmixer.buffer + SEND_OFFSET, 0, frames * 2 * sizeof(cmixer.buffer[0]));
   /* Zeroset callback queue (LS) */
   cm_clear_cb_queue();
 
-  /* Process active sources */
+  /* Process active sources, waking as many workers as there are voices
+  ** left for them (LS) */
   lock();
-  s = &cmixer.sources;
-  while (*s) {
-    process_source(*s, len);
-    /* Remove source from list if it is no longer playing */
-    if ((*s)->state != CM_STATE_PLAYING) {
-      (*s)->active = 0;
-      *s = (*s)->next;
+  update_emitters();
+  start_queued(frames);
+  nthreads = MIN(pool.nthreads, cmixer.voices.count - 1);
+  pool.frames = frames;
+  pool.profiling = profiling;
+  SDL_AtomicSet(&pool.next, 0);
+  for (i = 0; i < nthreads; i++) {
+    SDL_SemPost(pool.start);
+  }
+  used = ~0;
+  mix_voices(cmixer.buffer, frames, &used);
+  /* Every voice is claimed by now, so this only waits for the last voice of
+  ** each worker, no longer than mixing it here would have taken. A late
+  ** worker can't be skipped, as it still writes to its voice and buffer */
+  for (i = 0; i < nthreads; i++) {
+    SDL_SemWait(pool.done);
+  }
+  for (i = 0; i < pool.nthreads; i++) {
+    cm_Worker *w = &pool.worker[i];
+    for (c = 0; c < buses.count; c++) {
+      if (w->used & (1 << c)) {
+        for (v = c * BUS_SIZE; v < c * BUS_SIZE + len; v++) {
+          cmixer.buffer[v] += w->buffer[v];
+        }
+      }
+    }
+    if (w->used & (1 << SEND_REGION)) {
+      for (v = SEND_OFFSET; v < SEND_OFFSET + frames * 2; v++) {
+        cmixer.buffer[v] += w->buffer[v];
+      }
+    }
+    w->used = 0;
+  }
+
+  /* Submix buses into their parents (LS) */
+  for (i = buses.count - 1; i > 0; i--) {
+    mix_bus(i, frames);
+  }
+
+  /* Reverbs of the send bus or the whole mix into the front channels (LS) */
+  if (profiling) {
+    t = cmixer.time_function();
+  }
+  for (i = 0; i < frames * 2; i++) {
+    cmixer.wet[0][i] = cmixer.buffer[SEND_OFFSET + i];
+  }
+  if (cmixer.convolver) {
+    cm_convolver_process(cmixer.convolver, cmixer.wet[0], cmixer.wet[1], frames);
+    for (i = 0; i < frames; i++) {
+      cmixer.buffer[i * cmixer.bus    ] += floor(cmixer.wet[1][i * 2    ]);
+      cmixer.buffer[i * cmixer.bus + 1] += floor(cmixer.wet[1][i * 2 + 1]);
+    }
+  }
+  if (cmixer.fdn) {
+    if (cmixer.fdn_mode == CM_FDN_MASTER) {
+      for (i = 0; i < frames; i++) {
+        cmixer.wet[0][i * 2    ] = cmixer.buffer[i * cmixer.bus    ];
+        cmixer.wet[0][i * 2 + 1] = cmixer.buffer[i * cmixer.bus + 1];
+      }
+    }
+    cm_fdn_process(cmixer.fdn, cmixer.wet[0], cmixer.wet[1], frames);
+    for (i = 0; i < frames; i++) {
+      cmixer.buffer[i * cmixer.bus    ] += floor(cmixer.wet[1][i * 2    ] * cmixer.fdn_wet);
+      cmixer.buffer[i * cmixer.bus + 1] += floor(cmixer.wet[1][i * 2 + 1] * cmixer.fdn_wet);
+    }
+  }
+  if (profiling) {
+    stage[CM_PROF_EFFECTS] = cmixer.time_function() - t;
+  }
+
+  /* Collect the voice times before finished voices are removed (LS) */
+  if (profiling) {
+    prof_voices(stage);
+  }
+
+  /* Remove sources from table which are no longer playing */
+  v = 0;
+  while (v < cmixer.voices.count) {
+    if (cmixer.voices.src[v]->state != CM_STATE_PLAYING) {
+      remove_voice(v);
     } else {
-      s = &(*s)->next;
+      v++;
     }
   }
   unlock();
+
+  if (profiling) {
+    t = cmixer.time_function();
+  }
   process_cb_queue();
-  /* Copy internal buffer to destination and clip */
-  for (i = 0; i < len; i+=2) {
-	  
-		// (LS) get current sample:
-		cmixer.x0l = cmixer.buffer[i  ];
-		cmixer.x0r = cmixer.buffer[i+1];
-		
-		// (LS) calculate current output:
-		cmixer.y0l = cmixer.b0*(double)cmixer.x0l + cmixer.b1 * (double)cmixer.xl[0] + cmixer.b2 * (double)cmixer.xl[1] - (cmixer.a1*(double)cmixer.yl[0] + cmixer.a2*(double)cmixer.yl[1]);
-		cmixer.y0r = cmixer.b0*(double)cmixer.x0r + cmixer.b1 * (double)cmixer.xr[0] + cmixer.b2 * (double)cmixer.xr[1] - (cmixer.a1*(double)cmixer.yr[0] + cmixer.a2*(double)cmixer.yr[1]);
-		
-		// (LS) update sample memory:
-		cmixer.yl[1] = cmixer.yl[0];
-		cmixer.yr[1] = cmixer.yr[0];
-		cmixer.yl[0] = cmixer.y0l;
-		cmixer.yr[0] = cmixer.y0r;
-		cmixer.xl[1] = cmixer.xl[0];
-		cmixer.xr[1] = cmixer.xr[0];
-		cmixer.xl[0] = cmixer.x0l;
-		cmixer.xr[0] = cmixer.x0r;
-		
-		// (LS) add to master buffer with gain:
-        int yl = (cmixer.y0l * cmixer.gain) >> FX_BITS;
-        int yr = (cmixer.y0r * cmixer.gain) >> FX_BITS;
-		
-		dst[i  ] = CLAMP(yl, -32768, 32767);
-		dst[i+1] = CLAMP(yr, -32768, 32767);
+  if (profiling) {
+    stage[CM_PROF_CALLBACKS] = cmixer.time_function() - t;
+    t += stage[CM_PROF_CALLBACKS];
+  }
 
+  /* Filter and apply master gain, then clip and copy to destination */
+  gain = cmixer.gain / (double) FX_UNIT;
+  for (i = 0; i < len; i += cmixer.bus) {
+    for (c = 0; c < cmixer.bus; c += 2) {
+		// (LS) filter current sample:
+		cm_process_iir(&cmixer.iir[c / 2], cmixer.buffer[i+c], cmixer.buffer[i+c+1], &y0l, &y0r);
+		
+		// (LS) apply gain:
+		cmixer.output[i+c  ] = y0l * gain;
+		cmixer.output[i+c+1] = y0r * gain;
+    }
+  }
+  if (cmixer.limiter) {
+    cm_limiter_process(cmixer.limiter, cmixer.output, frames, cmixer.bus);
+  }
+  write_output(dst, len);
+
+  /* Advance the frame clock, see `cm_get_clock()` (LS) */
+  SDL_AtomicAdd(&cmixer.clock_seq, 1);
+  SDL_MemoryBarrierRelease();
+  cmixer.clock += frames;
+  SDL_MemoryBarrierRelease();
+  SDL_AtomicAdd(&cmixer.clock_seq, 1);
+
+  if (profiling) {
+    double t1 = cmixer.time_function();
+    stage[CM_PROF_MASTER] = t1 - t;
+    stage[CM_PROF_BLOCK] = t1 - t0;
+    prof_update(frames, stage);
   }
 }
 
 void cm_set_master_iir(double b0, double b1, double b2, double a1, double a2) // (LS)
 {
-	cmixer.b0 = b0;
-	cmixer.b1 = b1;
-	cmixer.b2 = b2;
-	cmixer.a1 = a1;
-	cmixer.a2 = a2;
+	int i;
+	for (i = 0; i < CM_MAX_OUTPUTS / 2; i++)
+	{
+		cmixer.iir[i].b0 = b0;
+		cmixer.iir[i].b1 = b1;
+		cmixer.iir[i].b2 = b2;
+		cmixer.iir[i].a1 = a1;
+		cmixer.iir[i].a2 = a2;
+	}
 	return;
 }
 
 
+/******************************************************************************
+** Submix buses (LS)
+******************************************************************************/
+
+int cm_new_bus(const char *name, int parent) {
+  int b;
+  if (buses.count == CM_MAX_BUSES) {
+    error("too many buses");
+    return -1;
+  }
+  if (buses.count > 0 && (parent < 0 || parent >= buses.count)) {
+    error("invalid parent bus");
+    return -1;
+  }
+  lock();
+  b = buses.count;
+  memset(&buses.bus[b], 0, sizeof(buses.bus[b]));
+  snprintf(buses.bus[b].name, sizeof(buses.bus[b].name), "%s", name ? name : "");
+  buses.bus[b].parent = parent;
+  buses.bus[b].gain = 1.0;
+  buses.bus[b].key = -1;
+  buses.count++;
+  unlock();
+  return b;
+}
+
+
+int cm_find_bus(const char *name) {
+  int b;
+  for (b = 0; b < buses.count; b++) {
+    if (!strcmp(buses.bus[b].name, name)) {
+      return b;
+    }
+  }
+  return -1;
+}
+
+
+static int check_bus(int bus) {
+  if (bus < 0 || bus >= buses.count) {
+    error("invalid bus");
+    return 0;
+  }
+  return 1;
+}
+
+
+void cm_set_bus_gain(int bus, double gain) {
+  if (!check_bus(bus)) {
+    return;
+  }
+  if (bus == CM_MASTER_BUS) {
+    cm_set_master_gain(gain);
+    return;
+  }
+  lock();
+  buses.bus[bus].gain = gain;
+  unlock();
+}
+
+
+void cm_set_bus_iir(int bus, int stage, double b0, double b1, double b2, double a1, double a2) {
+  int i;
+  if (!check_bus(bus)) {
+    return;
+  }
+  if (bus == CM_MASTER_BUS) {
+    if (stage != 0) {
+      error("the master bus has a single filter");
+      return;
+    }
+    cm_set_master_iir(b0, b1, b2, a1, a2);
+    return;
+  }
+  if (stage < 0 || stage >= BUS_FILTERS) {
+    error("invalid filter stage");
+    return;
+  }
+  lock();
+  for (i = 0; i < CM_MAX_OUTPUTS / 2; i++) {
+    cm_Biquad *f = &buses.bus[bus].iir[stage][i];
+    if (stage >= buses.bus[bus].nfilters) {
+      init_iir(f);
+    }
+    f->b0 = b0;
+    f->b1 = b1;
+    f->b2 = b2;
+    f->a1 = a1;
+    f->a2 = a2;
+  }
+  /* Unused stages up to this one pass the signal through */
+  while (buses.bus[bus].nfilters < stage) {
+    for (i = 0; i < CM_MAX_OUTPUTS / 2; i++) {
+      init_iir(&buses.bus[bus].iir[buses.bus[bus].nfilters][i]);
+    }
+    buses.bus[bus].nfilters++;
+  }
+  buses.bus[bus].nfilters = MAX(buses.bus[bus].nfilters, stage + 1);
+  unlock();
+}
+
+
+void cm_clear_bus_iir(int bus) {
+  if (!check_bus(bus)) {
+    return;
+  }
+  if (bus == CM_MASTER_BUS) {
+    cm_set_master_iir(1.0, 0.0, 0.0, 0.0, 0.0);
+    return;
+  }
+  lock();
+  buses.bus[bus].nfilters = 0;
+  unlock();
+}
+
+
+void cm_set_bus_effect(int bus, cm_BusEffect effect, void *udata) {
+  if (!check_bus(bus)) {
+    return;
+  }
+  if (bus == CM_MASTER_BUS) {
+    error("the master bus has no effect slot");
+    return;
+  }
+  lock();
+  buses.bus[bus].effect = effect;
+  buses.bus[bus].udata = udata;
+  unlock();
+}
+
+
+void cm_set_bus_ducking(int bus, int key, double threshold, double ratio, double attack, double release) {
+  cm_Compressor duck;
+  if (!check_bus(bus)) {
+    return;
+  }
+  if (key >= 0 && (key >= buses.count || key <= bus)) {
+    error("the key must be a bus created after the ducked bus");
+    return;
+  }
+  if (bus == CM_MASTER_BUS) {
+    error("the master bus can't be ducked");
+    return;
+  }
+  cm_compressor_init(&duck, cmixer.samplerate, 32768.0 * pow(10.0, threshold / 20.0), ratio, attack, release);
+  lock();
+  buses.bus[bus].key = key < 0 ? -1 : key;
+  buses.bus[bus].duck = duck;
+  unlock();
+}
+
+
+void cm_set_bus(cm_Source *src, int bus) {
+  if (!check_bus(bus)) {
+    return;
+  }
+  src->bus = bus;
+  src->dirty = 1;
+}
+
+
+static void clear_bus_history(int bus) {
+  int s, i;
+  for (s = 0; s < BUS_FILTERS; s++) {
+    for (i = 0; i < CM_MAX_OUTPUTS / 2; i++) {
+      cm_Biquad *f = &buses.bus[bus].iir[s][i];
+      memset(f->xl, 0, sizeof(f->xl));
+      memset(f->xr, 0, sizeof(f->xr));
+      memset(f->yl, 0, sizeof(f->yl));
+      memset(f->yr, 0, sizeof(f->yr));
+    }
+  }
+}
+
+
+/* Filter, process and scale the buffer of a bus into the one of its parent.
+** A plain bus is added as is */
+static void mix_bus(int bus, int frames) {
+  int i, c, s, len = frames * cmixer.bus;
+  cm_Int32 *src = cmixer.buffer + bus * BUS_SIZE;
+  cm_Int32 *dst = cmixer.buffer + buses.bus[bus].parent * BUS_SIZE;
+  double y0l, y0r, gain = buses.bus[bus].gain;
+  float *fx = cmixer.fx;
+
+  if (gain == 1.0 && buses.bus[bus].nfilters == 0 && !buses.bus[bus].effect && buses.bus[bus].key < 0) {
+    for (i = 0; i < len; i++) {
+      dst[i] += src[i];
+    }
+    return;
+  }
+
+  for (i = 0; i < len; i += cmixer.bus) {
+    for (c = 0; c < cmixer.bus; c += 2) {
+      y0l = src[i + c];
+      y0r = src[i + c + 1];
+      for (s = 0; s < buses.bus[bus].nfilters; s++) {
+        cm_process_iir(&buses.bus[bus].iir[s][c / 2], y0l, y0r, &y0l, &y0r);
+      }
+      fx[i + c    ] = y0l;
+      fx[i + c + 1] = y0r;
+    }
+  }
+  if (buses.bus[bus].effect) {
+    buses.bus[bus].effect(fx, frames, cmixer.bus, buses.bus[bus].udata);
+  }
+  if (buses.bus[bus].key >= 0) {
+    cm_compressor_process(&buses.bus[bus].duck, cmixer.buffer + buses.bus[bus].key * BUS_SIZE, fx, frames, cmixer.bus);
+  }
+  for (i = 0; i < len; i++) {
+    dst[i] += floor(fx[i] * gain);
+  }
+}
+
+
 cm_Source* cm_new_source(const cm_SourceInfo *info) {
   cm_Source *src = calloc(1, sizeof(*src));
   if (!src) {
@@ -444,28 +1847,17 @@ cm_Source* cm_new_source(const cm_SourceInfo *info) {
   src->handler = info->handler;
   src->length = info->length;
   src->samplerate = info->samplerate;
+  src->channels = info->channels == 1 ? 1 : 2; // (LS)
+  src->buffer = src->ring_buf;
+  src->ring = BUFFER_SIZE / 2;
   src->udata = info->udata;
   
-  // (LS) initialize IIR buffers
-  src->xl[0] = 0;
-  src->xl[1] = 0;
-  src->yl[0] = 0;
-  src->yl[1] = 0;
-  src->xr[0] = 0;
-  src->xr[1] = 0;
-  src->yr[0] = 0;
-  src->yr[1] = 0;
-  src->x0l = 0;
-  src->x0r = 0;
-  src->y0l = 0;
-  src->y0r = 0;
-  
-  // (LS) initialize IIR coefficients
-  src->a1 = 0.0;
-  src->a2 = 0.0;
-  src->b0 = 1.0;
-  src->b1 = 0.0;
-  src->b2 = 0.0; 
+  src->voice = -1;
+  init_iir(&src->iir); // (LS)
+  init_iir(&src->air); // (LS)
+  src->attenuation = 1.0; // (LS)
+  src->doppler = 1.0;
+  cm_set_attenuation(src, CM_ROLLOFF_INVERSE, 1.0, 1000.0, 1.0);
   
   cm_set_pan(src, 0);
   cm_set_pitch(src, 1);
@@ -479,39 +1871,398 @@ static const char* wav_init(cm_SourceInfo *info, void *data, int len, int ownsda
 
 #ifdef CM_USE_STB_VORBIS
 static const char* ogg_init(cm_SourceInfo *info, void *data, int len, int ownsdata);
+static void stream_handler(cm_Event *e); // LS
 #endif
 
 
-static int check_header(void *data, int size, char *str, int offset) {
-  int len = strlen(str);
-  return (size >= offset + len) && !memcmp((char*) data + offset, str, len);
+static int check_header(void *data, int size, char *str, int offset) {
+  int len = strlen(str);
+  return (size >= offset + len) && !memcmp((char*) data + offset, str, len);
+}
+
+
+static const char* init_source_info(cm_SourceInfo *info, void *data, int size, int ownsdata) {
+  if (check_header(data, size, "WAVE", 8)) {
+    return wav_init(info, data, size, ownsdata);
+  }
+
+#ifdef CM_USE_STB_VORBIS
+  if (check_header(data, size, "OggS", 0)) {
+    return ogg_init(info, data, size, ownsdata);
+  }
+#endif
+
+  return error("unknown format or invalid data");
+}
+
+
+static cm_Source* new_source_from_mem(void *data, int size, int ownsdata) {
+  cm_SourceInfo info;
+
+  if (init_source_info(&info, data, size, ownsdata)) {
+    return NULL;
+  }
+  return cm_new_source(&info);
+}
+
+
+static void put_le(char *p, cm_UInt32 x, int bytes) { // (LS)
+  int i;
+  for (i = 0; i < bytes; i++) {
+    p[i] = (x >> (8 * i)) & 0xff;
+  }
+}
+
+
+static void put_wav_header(char *wav, int frames, int channels, int samplerate, int size) { // (LS)
+  /* 16bit PCM, the data follows at offset 44 */
+  memcpy(wav, "RIFF", 4);
+  put_le(wav + 4, size - 8, 4);
+  memcpy(wav + 8, "WAVEfmt ", 8);
+  put_le(wav + 16, 16, 4);
+  put_le(wav + 20, 1, 2);
+  put_le(wav + 22, channels, 2);
+  put_le(wav + 24, samplerate, 4);
+  put_le(wav + 28, samplerate * channels * 2, 4);
+  put_le(wav + 32, channels * 2, 2);
+  put_le(wav + 34, 16, 2);
+  memcpy(wav + 36, "data", 4);
+  put_le(wav + 40, frames * channels * 2, 4);
+}
+
+
+static void put_smpl_chunk(char *smpl, int samplerate, int start, int end) { // (LS)
+  /* 68 bytes with a single loop, whose end frame is inclusive */
+  memset(smpl, 0, 68);
+  memcpy(smpl, "smpl", 4);
+  put_le(smpl + 4, 60, 4);
+  put_le(smpl + 16, 1000000000.0 / samplerate, 4);
+  put_le(smpl + 20, 60, 4);
+  put_le(smpl + 36, 1, 4);
+  put_le(smpl + 52, start, 4);
+  put_le(smpl + 56, end - 1, 4);
+}
+
+
+/* (LS) Decode a whole sound into PCM of `info->channels`. The loop region of
+** the file is returned in `loop` if it isn't NULL, with an end of 0 if there
+** is none */
+static cm_Int16* decode_sound(void *data, int size, cm_SourceInfo *info, int *loop) {
+  cm_Event e;
+  cm_Int16 *pcm;
+
+  if (init_source_info(info, data, size, 0)) {
+    return NULL;
+  }
+  pcm = malloc(info->length * info->channels * sizeof(*pcm));
+  e.udata = info->udata;
+  if (pcm) {
+    e.type = CM_EVENT_SAMPLES;
+    e.buffer = pcm;
+    e.length = info->length * info->channels;
+    info->handler(&e);
+  } else {
+    error("allocation failed");
+  }
+  /* Only asks for the file's region, the handler keeps playing it through */
+  if (loop) {
+    e.type = CM_EVENT_LOOP;
+    e.start = e.length = -1;
+    info->handler(&e);
+    loop[0] = e.start;
+    loop[1] = MAX(e.length, 0);
+  }
+  e.type = CM_EVENT_DESTROY;
+  info->handler(&e);
+  return pcm;
+}
+
+
+/* (LS) Frame read by a resampling filter's tap at frame `m`, or -1 where the
+** sound is padded with silence. Filtering frames inside a loop region, taps
+** past its end read from its start, so the loop stays seamless */
+static int tap_frame(int m, int length, const int *loop) {
+  if (loop && m >= loop[1]) {
+    m = loop[0] + (m - loop[1]) % (loop[1] - loop[0]);
+  }
+  return m >= 0 && m < length ? m : -1;
+}
+
+
+void* cm_resample_to_wav(void *data, int size, int *outsize) { // (LS)
+  const int phases = 1024;
+  cm_SourceInfo info;
+  cm_Int16 *pcm, *out;
+  double *table = NULL, *c, ratio, pos, cutoff, l;
+  char *wav;
+  int taps, length, channels, i, j, k, m, n, ch, loop[2];
+
+  /* Decode the whole sound */
+  pcm = decode_sound(data, size, &info, loop);
+  if (!pcm) {
+    return NULL;
+  }
+  length = info.length;
+  channels = info.channels;
+  if (loop[0] < 0 || loop[1] <= loop[0]) {
+    loop[1] = 0;
+  }
+
+  /* Windowed-sinc table, widened when converting to a lower rate so the
+  ** cutoff stays below the new Nyquist frequency */
+  ratio = info.samplerate / (double) cmixer.samplerate;
+  taps = CM_SINC_TAPS * ceil(MAX(ratio, 1.0));
+  cutoff = 0.9 / MAX(ratio, 1.0);
+  *outsize = 44 + (int) (length / ratio) * channels * 2;
+  if (loop[1]) {
+    *outsize += 68;
+  }
+  if (ratio != 1.0) {
+    table = malloc(phases * taps * sizeof(*table));
+  }
+  wav = malloc(*outsize);
+  if ((!table && ratio != 1.0) || !wav) {
+    free(table);
+    free(wav);
+    free(pcm);
+    error("allocation failed");
+    return NULL;
+  }
+  for (i = 0; table && i < phases; i++) {
+    c = table + i * taps;
+    sinc_row(c, taps, i / (double) phases, cutoff);
+    for (l = 0.0, k = 0; k < taps; k++) {
+      l += c[k];
+    }
+    for (k = 0; k < taps; k++) {
+      c[k] /= l;
+    }
+  }
+
+  /* Resample, or copy if the rate is already right */
+  out = (cm_Int16*) (wav + 44);
+  n = (int) (length / ratio);
+  if (!table) {
+    memcpy(out, pcm, n * channels * sizeof(*out));
+  }
+  for (j = 0; table && j < n; j++) {
+    pos = j * ratio;
+    i = (int) pos - (taps / 2 - 1);
+    c = table + (int) ((pos - floor(pos)) * phases) * taps;
+    for (ch = 0; ch < channels; ch++) {
+      l = 0.0;
+      for (k = 0; k < taps; k++) {
+        m = tap_frame(i + k, length, loop[1] && pos < loop[1] ? loop : NULL);
+        if (m >= 0) {
+          l += pcm[m * channels + ch] * c[k];
+        }
+      }
+      out[j * channels + ch] = CLAMP(floor(l + 0.5), -32768, 32767);
+    }
+  }
+  free(table);
+  free(pcm);
+
+  put_wav_header(wav, n, channels, cmixer.samplerate, *outsize);
+
+  /* Sampler chunk with the loop region at the new rate */
+  if (loop[1]) {
+    put_smpl_chunk(wav + 44 + n * channels * 2, cmixer.samplerate,
+                   MIN(floor(loop[0] / ratio + 0.5), n - 1),
+                   MIN(floor(loop[1] / ratio + 0.5), n));
+  }
+
+  return wav;
+}
+
+
+/* (LS) Taps on either side of the middle one of the mipmaps' half-band
+** lowpass. Only those at odd distances are nonzero, so these are stored */
+#define MIP_TAPS 12
+
+/* (LS) Halve the rate of `len` frames with the half-band lowpass, padding
+** and wrapping in the `loop` region (end 0 if none) like
+** `cm_resample_to_wav()`. Output frame `i` lies on input frame `2 * i` */
+static void mip_halve(const cm_Int16 *in, int len, int channels, const int *loop, const double *h, cm_Int16 *out) {
+  int i, k, ch, a, b;
+  double x;
+  for (i = 0; 2 * i < len; i++) {
+    for (ch = 0; ch < channels; ch++) {
+      x = h[0] * in[2 * i * channels + ch];
+      for (k = 1; k <= MIP_TAPS; k++) {
+        a = tap_frame(2 * i - 2 * k + 1, len, NULL);
+        b = tap_frame(2 * i + 2 * k - 1, len, loop[1] && 2 * i < loop[1] ? loop : NULL);
+        x += h[k] * ((a >= 0 ? in[a * channels + ch] : 0) + (b >= 0 ? in[b * channels + ch] : 0));
+      }
+      out[i * channels + ch] = CLAMP(floor(x + 0.5), -32768, 32767);
+    }
+  }
+}
+
+
+cm_Mipmap* cm_build_mipmap(void *data, int size, int levels) { // (LS)
+  cm_SourceInfo info;
+  cm_Mipmap *mip;
+  cm_Int16 *pcm, *out;
+  const cm_Int16 *in;
+  double h[MIP_TAPS + 1], sum, x;
+  int i, k, len, loop[2], total = 0;
+
+  /* Decode the whole sound */
+  pcm = decode_sound(data, size, &info, loop);
+  if (!pcm) {
+    return NULL;
+  }
+  if (loop[0] < 0 || loop[1] <= loop[0]) {
+    loop[1] = 0;
+  }
+  levels = CLAMP(levels, 1, CM_MIP_LEVELS);
+  for (len = info.length, i = 0; i < levels; i++) {
+    len = (len + 1) / 2;
+    total += len;
+  }
+  mip = malloc(sizeof(*mip) + total * info.channels * sizeof(*pcm));
+  if (!mip) {
+    free(pcm);
+    error("allocation failed");
+    return NULL;
+  }
+
+  /* Kaiser windowed half-band sinc, normalized to unity gain */
+  h[0] = sum = 0.5;
+  for (k = 1; k <= MIP_TAPS; k++) {
+    x = 2 * k - 1;
+    h[k] = sin(M_PI * 0.5 * x) / (M_PI * x) *
+           bessel_i0(7.0 * sqrt(1.0 - (x / (2 * MIP_TAPS)) * (x / (2 * MIP_TAPS)))) / bessel_i0(7.0);
+    sum += 2.0 * h[k];
+  }
+  for (k = 0; k <= MIP_TAPS; k++) {
+    h[k] /= sum;
+  }
+
+  /* Each level is made from the one above */
+  mip->levels = levels;
+  mip->channels = info.channels;
+  mip->length = info.length;
+  in = pcm;
+  len = info.length;
+  out = (cm_Int16*) (mip + 1);
+  for (i = 0; i < levels; i++) {
+    mip_halve(in, len, info.channels, loop, h, out);
+    len = (len + 1) / 2;
+    loop[0] = (loop[0] + 1) / 2;
+    loop[1] = (loop[1] + 1) / 2;
+    if (loop[1] <= loop[0]) {
+      loop[1] = 0;
+    }
+    mip->level[i] = out;
+    mip->frames[i] = len;
+    in = out;
+    out += len * info.channels;
+  }
+  free(pcm);
+  return mip;
+}
+
+
+int cm_set_fdn(int mode, double rt60, double damping, double size, double wet) { // (LS)
+  cm_Fdn *fdn = NULL, *old;
+
+  if (mode != CM_FDN_OFF) {
+    fdn = cm_fdn_new(cmixer.samplerate, MAX(rt60, 0.01), damping, CLAMP(size, 0.05, 4.0));
+    if (!fdn) {
+      error("allocation failed");
+      return -1;
+    }
+  }
+
+  lock();
+  old = cmixer.fdn;
+  cmixer.fdn = fdn;
+  cmixer.fdn_mode = mode;
+  cmixer.fdn_wet = wet;
+  unlock();
+  if (old) {
+    cm_fdn_destroy(old);
+  }
+  return 0;
+}
+
+
+int cm_set_limiter(double ceiling, double lookahead, double release) { // (LS)
+  cm_Limiter *limiter = NULL, *old;
+
+  if (lookahead > 0.0) {
+    limiter = cm_limiter_new(cmixer.samplerate, 32768.0 * pow(10.0, MIN(ceiling, 0.0) / 20.0), MIN(lookahead, 0.1), release);
+    if (!limiter) {
+      error("allocation failed");
+      return -1;
+    }
+  }
+
+  lock();
+  old = cmixer.limiter;
+  cmixer.limiter = limiter;
+  unlock();
+  if (old) {
+    cm_limiter_destroy(old);
+  }
+  return 0;
+}
+
+
+double cm_get_limiter_gain(void) { // (LS)
+  double gain;
+  lock();
+  gain = cmixer.limiter ? cm_limiter_get_gain(cmixer.limiter) : 1.0;
+  unlock();
+  return gain;
 }
 
 
-static cm_Source* new_source_from_mem(void *data, int size, int ownsdata) {
-  const char *err;
+int cm_set_convolution(void *data, int size, int threaded) { // (LS)
   cm_SourceInfo info;
+  cm_Convolver *conv = NULL, *old;
+  cm_Int16 *pcm = NULL;
+  void *wav = NULL;
+  float *ir;
+  int i;
 
-  if (check_header(data, size, "WAVE", 8)) {
-    err = wav_init(&info, data, size, ownsdata);
-    if (err) {
-      return NULL;
+  if (data) {
+    /* Impulse responses are convolved at the output rate */
+    pcm = decode_sound(data, size, &info, NULL);
+    if (pcm && info.samplerate != cmixer.samplerate) {
+      free(pcm);
+      wav = cm_resample_to_wav(data, size, &size);
+      pcm = wav ? decode_sound(wav, size, &info, NULL) : NULL;
+      free(wav);
     }
-    return cm_new_source(&info);
-  }
-
-#ifdef CM_USE_STB_VORBIS
-  if (check_header(data, size, "OggS", 0)) {
-    err = ogg_init(&info, data, size, ownsdata);
-    if (err) {
-      return NULL;
+    if (!pcm) {
+      return -1;
+    }
+    ir = malloc(info.length * 2 * sizeof(*ir));
+    if (ir) {
+      for (i = 0; i < info.length * 2; i++) {
+        ir[i] = pcm[info.channels == 1 ? i / 2 : i] / 32768.0f;
+      }
+      conv = cm_convolver_new(ir, info.length, threaded);
+    }
+    free(ir);
+    free(pcm);
+    if (!conv) {
+      error("allocation failed");
+      return -1;
     }
-    return cm_new_source(&info);
   }
-#endif
 
-  error("unknown format or invalid data");
-  return NULL;
+  lock();
+  old = cmixer.convolver;
+  cmixer.convolver = conv;
+  unlock();
+  if (old) {
+    cm_convolver_destroy(old);
+  }
+  return 0;
 }
 
 
@@ -578,21 +2329,16 @@ cm_Source* cm_new_source_from_mem(void *data, int size) {
 void cm_destroy_source(cm_Source *src) {
   cm_Event e;
   lock();
-  if (src->active) {
-    cm_Source **s = &cmixer.sources;
-    while (*s) {
-		//printf("Destroyed source\n");
-      if (*s == src) {
-        *s = src->next;
-        break;
-      }
-      s = &((*s)->next); // (LS) fixed infinity loop
-    }
+  if (src->voice >= 0) {
+    remove_voice(src->voice);
   }
   unlock();
   e.type = CM_EVENT_DESTROY;
   e.udata = src->udata;
   src->handler(&e);
+  if (src->buffer != src->ring_buf) {
+    free(src->buffer);
+  }
   free(src);
 }
 
@@ -603,7 +2349,11 @@ double cm_get_length(cm_Source *src) {
 
 
 double cm_get_position(cm_Source *src) {
-  return ((src->position >> FX_BITS) % src->length) / (double) src->samplerate;
+  cm_Int64 frame = src->position >> POS_BITS;
+  if (src->loop && src->loop_end && frame >= src->loop_end) { // (LS)
+    return (src->loop_start + (frame - src->loop_start) % next_pass(src)) / (double) src->samplerate;
+  }
+  return (frame % src->length) / (double) src->samplerate;
 }
 
 
@@ -613,55 +2363,614 @@ int cm_get_state(cm_Source *src) {
 
 
 static void recalc_source_gains(cm_Source *src) {
-  double l, r;
-  double pan = src->pan;
-  l = src->gain * (pan <= 0. ? 1. : 1. - pan);
-  r = src->gain * (pan >= 0. ? 1. : 1. + pan);
-  src->lgain = FX_FROM_FLOAT(l);
-  src->rgain = FX_FROM_FLOAT(r);
+  int i;
+  double gain = src->gain * src->attenuation;
+  for (i = 0; i < src->nspeakers; i++) {
+    src->lgain[i] = FX_FROM_FLOAT(gain * src->lweight[i]);
+    src->rgain[i] = FX_FROM_FLOAT(gain * src->rweight[i]);
+  }
+  src->send = FX_FROM_FLOAT(gain * src->send_level);
+  src->dirty = 1;
+}
+
+
+/* (LS) Work out the pan law of the source, which only changes with its pan
+** or direction. Pan sends the left and right input to the front left and
+** right channels. A direction folds the input down to mono and pans it over
+** the speaker layout; a spread source is rendered as SPREAD_STEPS directions
+** across the spread adding up their power, and with rising elevation the
+** power is spread evenly over all speakers. */
+static void recalc_pan_law(cm_Source *src) {
+  double power[CM_MAX_OUTPUTS], g1, g2, az, el;
+  int i, k, ch1, ch2, steps;
+
+  if (!src->directional) {
+    src->nspeakers = 2;
+    src->speaker[0] = 0;
+    src->speaker[1] = 1;
+    src->lweight[0] = src->pan <= 0. ? 1. : 1. - src->pan;
+    src->rweight[0] = 0.;
+    src->lweight[1] = 0.;
+    src->rweight[1] = src->pan >= 0. ? 1. : 1. + src->pan;
+    return;
+  }
+
+  memset(power, 0, sizeof(power));
+  steps = src->spread > 0.0 ? SPREAD_STEPS : 1;
+  for (k = 0; k < steps; k++) {
+    az = src->azimuth + src->spread * ((k + 0.5) / steps - 0.5);
+    pan_direction(az * M_PI / 180.0, &ch1, &ch2, &g1, &g2);
+    power[ch1] += g1 * g1 / steps;
+    power[ch2] += g2 * g2 / steps;
+  }
+  el = sin(src->elevation * M_PI / 180.0);
+  for (i = 0; i < layout.count; i++) {
+    ch1 = layout.channel[i];
+    power[ch1] = (1.0 - el * el) * power[ch1] + el * el / layout.count;
+  }
+
+  src->nspeakers = 0;
+  for (i = 0; i < cmixer.bus; i++) {
+    if (power[i] > 1e-6) {
+      k = src->nspeakers++;
+      src->speaker[k] = i;
+      src->lweight[k] = src->rweight[k] = 0.5 * sqrt(power[i]);
+    }
+  }
 }
 
 
+/* (LS) The setters below recalculate the speaker gains under the lock, as the
+** mixer copies them to the voice from the audio and worker threads */
 void cm_set_gain(cm_Source *src, double gain) {
+  lock();
   src->gain = gain;
   recalc_source_gains(src);
+  unlock();
 }
 
 
 void cm_set_pan(cm_Source *src, double pan) {
+  lock();
   src->pan = CLAMP(pan, -1.0, 1.0);
+  src->directional = 0;
+  detach_emitter(src);
+  recalc_pan_law(src);
   recalc_source_gains(src);
+  unlock();
 }
 
 
-void cm_set_pitch(cm_Source *src, double pitch) {
+void cm_set_send(cm_Source *src, double level) { // (LS)
+  lock();
+  src->send_level = MAX(level, 0.0);
+  recalc_source_gains(src);
+  unlock();
+}
+
+
+void cm_set_direction(cm_Source *src, double azimuth, double elevation, double spread) { // (LS)
+  lock();
+  src->azimuth = azimuth;
+  src->elevation = CLAMP(elevation, -90.0, 90.0);
+  src->spread = CLAMP(spread, 0.0, 360.0);
+  src->directional = 1;
+  detach_emitter(src);
+  recalc_pan_law(src);
+  recalc_source_gains(src);
+  unlock();
+}
+
+
+static void recalc_rate(cm_Source *src) {
   double rate;
-  if (pitch > 0.) {
-    rate = src->samplerate / (double) cmixer.samplerate * pitch;
+  if (src->pitch > 0.) {
+    rate = src->samplerate / (double) cmixer.samplerate * src->pitch * src->doppler;
   } else {
     rate = 0.001;
   }
-  src->rate = FX_FROM_FLOAT(rate);
+  src->rate = POS_FROM_FLOAT(rate);
+  src->dirty = 1;
+}
+
+
+/* (LS) Ring size for a rate. The ring is refilled half at a time, and half
+** of it should hold what half a mix chunk reads at that rate, so a fast voice
+** still goes through its handler about twice per chunk */
+static int ring_for_rate(cm_Int64 rate) {
+  int frames = BUFFER_SIZE / 2;
+  while (frames < CM_MAX_RING && frames / 2 < (BUS_FRAMES / 2) * ((double) rate / POS_UNIT)) {
+    frames *= 2;
+  }
+  return frames;
+}
+
+
+void cm_set_pitch(cm_Source *src, double pitch) {
+  src->pitch = pitch;
+  recalc_rate(src);
+  if (ring_for_rate(src->rate >> mip_level(src, src->rate, 0)) > src->ring) { // (LS)
+    cm_set_ring_size(src, 0);
+  }
+}
+
+
+void cm_set_ring_size(cm_Source *src, int frames) { // (LS)
+  cm_Voices *vs = &cmixer.voices;
+  cm_Int16 *ring, *old = src->buffer;
+  int f, c, nextfill, size = BUFFER_SIZE / 2;
+  if (frames <= 0) {
+    frames = ring_for_rate(src->rate >> mip_level(src, src->rate, 0));
+  }
+  while (size < frames && size < CM_MAX_RING) {
+    size *= 2;
+  }
+  if (size == src->ring) {
+    return;
+  }
+  if (size == BUFFER_SIZE / 2) {
+    ring = src->ring_buf;
+  } else {
+    ring = malloc(size * src->channels * sizeof(*ring));
+    if (!ring) {
+      error("allocation failed");
+      return;
+    }
+  }
+
+  /* Move what the ring holds over, as the source may be playing */
+  lock();
+  nextfill = src->voice >= 0 ? vs->nextfill[src->voice] : src->nextfill;
+  for (f = nextfill - MIN(size, src->ring); f < nextfill; f++) {
+    for (c = 0; c < src->channels; c++) {
+      ring[(f & (size - 1)) * src->channels + c] = old[(f & (src->ring - 1)) * src->channels + c];
+    }
+  }
+  src->buffer = ring;
+  src->ring = size;
+  if (src->voice >= 0) {
+    vs->ring[src->voice] = ring;
+    vs->mask[src->voice] = size - 1;
+  }
+  unlock();
+
+  if (old != src->ring_buf) {
+    free(old);
+  }
+}
+
+
+/*============================================================================
+** Emitters and listener (LS)
+**============================================================================*/
+
+static double dot3(const double *a, const double *b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+
+static void normalize3(double *a) {
+  double len = sqrt(dot3(a, a));
+  if (len > 0.0) {
+    a[0] /= len;
+    a[1] /= len;
+    a[2] /= len;
+  }
+}
+
+
+void cm_set_listener(const double *position, const double *velocity, const double *forward, const double *up) {
+  static const double zero[3] = { 0, 0, 0 };
+  static const double front[3] = { 0, 0, -1 };
+  static const double above[3] = { 0, 1, 0 };
+  double f[3], u[3], r[3], d;
+  int i;
+
+  position = position ? position : zero;
+  velocity = velocity ? velocity : zero;
+  memcpy(f, forward ? forward : front, sizeof(f));
+  memcpy(u, up ? up : above, sizeof(u));
+
+  /* Make the orientation orthonormal, right = forward x up */
+  normalize3(f);
+  d = dot3(u, f);
+  for (i = 0; i < 3; i++) {
+    u[i] -= d * f[i];
+  }
+  normalize3(u);
+  r[0] = f[1] * u[2] - f[2] * u[1];
+  r[1] = f[2] * u[0] - f[0] * u[2];
+  r[2] = f[0] * u[1] - f[1] * u[0];
+
+  lock();
+  memcpy(listener.position, position, sizeof(listener.position));
+  memcpy(listener.velocity, velocity, sizeof(listener.velocity));
+  memcpy(listener.forward, f, sizeof(f));
+  memcpy(listener.up, u, sizeof(u));
+  memcpy(listener.right, r, sizeof(r));
+  unlock();
+}
+
+
+void cm_set_doppler(double speed_of_sound, double factor) {
+  listener.speed_of_sound = MAX(speed_of_sound, 1e-3);
+  listener.doppler_factor = MAX(factor, 0.0);
+}
+
+
+void cm_set_air_absorption(double distance) {
+  listener.air_distance = MAX(distance, 0.0);
+}
+
+
+void cm_set_emitter(cm_Source *src, const double *position, const double *velocity) {
+  static const double zero[3] = { 0, 0, 0 };
+  if (!position) {
+    error("the emitter needs a position");
+    return;
+  }
+  /* The audio thread reads these when it updates the emitters */
+  lock();
+  memcpy(src->emitter_pos, position, sizeof(src->emitter_pos));
+  memcpy(src->emitter_vel, velocity ? velocity : zero, sizeof(src->emitter_vel));
+  if (!src->emitter) {
+    src->air_cutoff = 0.0;
+    src->emitter = 1;
+  }
+  unlock();
+}
+
+
+void cm_set_attenuation(cm_Source *src, int curve, double min_distance, double max_distance, double rolloff) {
+  src->rolloff_curve = CLAMP(curve, CM_ROLLOFF_INVERSE, CM_ROLLOFF_EXPONENTIAL);
+  src->min_distance = MAX(min_distance, 1e-3);
+  src->max_distance = MAX(max_distance, src->min_distance);
+  src->rolloff = MAX(rolloff, 0.0);
+}
+
+
+/* Second order Butterworth lowpass for the air absorption, which runs after
+** the source's own filter. A bypass if the cutoff is 0 or close to the
+** Nyquist frequency */
+static void set_air_lowpass(cm_Source *src, double cutoff) {
+  cm_Biquad *f = &src->air;
+  double w, c, alpha, a0;
+  src->air_cutoff = cutoff;
+  src->dirty = 1;
+  if (cutoff <= 0.0 || cutoff >= 0.45 * cmixer.samplerate) {
+    f->b0 = 1.0;
+    f->b1 = f->b2 = f->a1 = f->a2 = 0.0;
+    return;
+  }
+  w = 2.0 * M_PI * cutoff / cmixer.samplerate;
+  c = cos(w);
+  alpha = sin(w) / M_SQRT2;
+  a0 = 1.0 + alpha;
+  f->b0 = 0.5 * (1.0 - c) / a0;
+  f->b1 = (1.0 - c) / a0;
+  f->b2 = 0.5 * (1.0 - c) / a0;
+  f->a1 = -2.0 * c / a0;
+  f->a2 = (1.0 - alpha) / a0;
+}
+
+
+/* Return a source to its own gain and pitch, without the air absorption, when
+** it stops being an emitter */
+static void detach_emitter(cm_Source *src) {
+  if (!src->emitter) {
+    return;
+  }
+  src->emitter = 0;
+  src->attenuation = 1.0;
+  src->doppler = 1.0;
+  recalc_rate(src);
+  if (src->air_cutoff > 0.0) {
+    set_air_lowpass(src, 0.0);
+  }
+}
+
+
+/* Position all playing emitters relative to the listener, once per block on
+** the audio thread. The geometry is gathered into arrays first so distance,
+** attenuation and Doppler shift are computed in plain loops over all
+** emitters. The results are fed through the sources' own setters and reach
+** the voices through the dirty flag like any other change; the pan law and
+** filter are only recomputed when they have changed noticeably. */
+static void update_emitters(void) {
+  cm_Voices *vs = &cmixer.voices;
+  cm_Source *src, *emitters[CM_MAX_VOICES];
+  double rel[3][CM_MAX_VOICES], dist[CM_MAX_VOICES];
+  double gain[CM_MAX_VOICES], shift[CM_MAX_VOICES];
+  double u[3], d, lo, hi, c, vlis, vsrc, az, el, cutoff;
+  int i, k, v, n = 0;
+
+  /* Gather */
+  for (v = 0; v < vs->count; v++) {
+    src = vs->src[v];
+    if (src->emitter && src->state == CM_STATE_PLAYING) {
+      for (k = 0; k < 3; k++) {
+        rel[k][n] = src->emitter_pos[k] - listener.position[k];
+      }
+      emitters[n++] = src;
+    }
+  }
+  if (n == 0) {
+    return;
+  }
+
+  /* Distance and attenuation */
+  for (i = 0; i < n; i++) {
+    dist[i] = sqrt(rel[0][i] * rel[0][i] + rel[1][i] * rel[1][i] + rel[2][i] * rel[2][i]);
+  }
+  for (i = 0; i < n; i++) {
+    src = emitters[i];
+    lo = src->min_distance;
+    hi = src->max_distance;
+    d = CLAMP(dist[i], lo, hi);
+    switch (src->rolloff_curve) {
+      case CM_ROLLOFF_INVERSE: gain[i] = lo / (lo + src->rolloff * (d - lo)); break;
+      case CM_ROLLOFF_LINEAR: gain[i] = hi > lo ? 1.0 - src->rolloff * (d - lo) / (hi - lo) : 1.0; break;
+      default: gain[i] = pow(d / lo, -src->rolloff); break;
+    }
+    gain[i] = CLAMP(gain[i], 0.0, 1.0);
+  }
+
+  /* Doppler shift from the velocities along the line of sight, the speeds
+  ** are limited to below the speed of sound */
+  c = listener.speed_of_sound;
+  for (i = 0; i < n; i++) {
+    src = emitters[i];
+    d = dist[i] > 1e-9 ? 1.0 / dist[i] : 0.0;
+    u[0] = rel[0][i] * d;
+    u[1] = rel[1][i] * d;
+    u[2] = rel[2][i] * d;
+    vlis = listener.doppler_factor * dot3(listener.velocity, u);
+    vsrc = listener.doppler_factor * dot3(src->emitter_vel, u);
+    vlis = CLAMP(vlis, -0.9 * c, 0.9 * c);
+    vsrc = CLAMP(vsrc, -0.9 * c, 0.9 * c);
+    shift[i] = (c + vlis) / (c + vsrc);
+  }
+
+  /* Scatter */
+  for (i = 0; i < n; i++) {
+    src = emitters[i];
+
+    /* Direction in the listener's frame */
+    if (dist[i] > 1e-9) {
+      u[0] = rel[0][i] / dist[i];
+      u[1] = rel[1][i] / dist[i];
+      u[2] = rel[2][i] / dist[i];
+      az = atan2(dot3(u, listener.right), dot3(u, listener.forward)) * 180.0 / M_PI;
+      el = asin(CLAMP(dot3(u, listener.up), -1.0, 1.0)) * 180.0 / M_PI;
+    } else {
+      az = el = 0.0;
+    }
+    d = fabs(az - src->azimuth);
+    if (!src->directional || MIN(d, 360.0 - d) > 0.5 || fabs(el - src->elevation) > 0.5) {
+      src->azimuth = az;
+      src->elevation = el;
+      src->directional = 1;
+      recalc_pan_law(src);
+    }
+
+    src->attenuation = gain[i];
+    recalc_source_gains(src);
+    if (src->doppler != shift[i]) {
+      src->doppler = shift[i];
+      recalc_rate(src);
+    }
+
+    /* Air absorption halves the cutoff every `air_distance` */
+    if (listener.air_distance > 0.0) {
+      cutoff = 20000.0 * pow(2.0, -dist[i] / listener.air_distance);
+      cutoff = MAX(cutoff, 100.0);
+      if (src->air_cutoff == 0.0 || fabs(cutoff / src->air_cutoff - 1.0) > 0.02) {
+        set_air_lowpass(src, cutoff);
+      }
+    } else if (src->air_cutoff > 0.0) {
+      set_air_lowpass(src, 0.0);
+    }
+  }
+}
+
+
+void cm_set_interpolation(cm_Source *src, int interp) { // (LS)
+  src->interp = CLAMP(interp, CM_INTERP_LINEAR, CM_INTERP_SINC);
+  src->dirty = 1;
+}
+
+
+/* (LS) Hand the loop region to the handler, which only wraps at its end
+** while the source loops. A handler that can't loop it hands back another.
+** Only called while the source isn't playing; the handler may start, stop or
+** wait for the I/O thread, so the lock is only taken to publish the result */
+static void send_loop_region(cm_Source *src) {
+  cm_Event e;
+  e.type = CM_EVENT_LOOP;
+  e.udata = src->udata;
+  e.start = src->loop ? src->loop_start : 0;
+  e.length = src->loop ? src->loop_end : 0;
+  src->handler(&e);
+  if (src->loop && e.length != src->loop_end) {
+    lock();
+    src->loop_start = src->loop_end = 0;
+    unlock();
+  }
 }
 
 
 void cm_set_loop(cm_Source *src, int loop) {
+  /* (LS) The handler decodes the wrap at the end of a loop region ahead */
+  if (src->loop_end && !loop != !src->loop) {
+    if (src->voice >= 0) {
+      error("can't change the looping of a playing source with a loop region");
+      return;
+    }
+    src->loop = loop;
+    send_loop_region(src);
+    return;
+  }
   src->loop = loop;
 }
 
 
+/* (LS) A source with a loop region plays up to `end` and then, if it loops,
+** from `start` to `end` over and over; if it doesn't, it plays to the end of
+** the sound. The handler decodes the wrap ahead, so the region can only be
+** changed while the source isn't playing. `end` 0 removes the region, -1 for
+** both uses the one stored in the file if any */
+void cm_set_loop_region(cm_Source *src, int start, int end) {
+  cm_Event e;
+  if (src->voice >= 0) {
+    error("can't change the loop region of a playing source");
+    return;
+  }
+  if (end != -1 && end != 0 && (start < 0 || start >= end || end > src->length)) {
+    error("invalid loop region");
+    return;
+  }
+  /* The handler answers -1 with the file's region, or 0 if it has none */
+  if (end == -1) {
+    e.type = CM_EVENT_LOOP;
+    e.udata = src->udata;
+    e.start = e.length = -1;
+    src->handler(&e);
+    start = e.start;
+    end = e.length;
+  }
+  if (end > 0 && start >= 0 && start < end && end <= src->length) {
+    src->loop_start = start;
+    src->loop_end = end;
+  } else {
+    src->loop_start = src->loop_end = 0;
+  }
+  send_loop_region(src);
+}
+
+
 void cm_play(cm_Source *src) {
+  cm_play_at(src, 0);
+}
+
+
+/* (LS) The source becomes active right away but is only mixed from the mixer
+** frame `time` on, so the start is sample accurate within a block */
+void cm_play_at(cm_Source *src, cm_UInt64 time) {
   lock();
+  if (src->voice < 0) {
+    if (cmixer.voices.count == CM_MAX_VOICES) {
+      unlock();
+      error("too many active sources");
+      return;
+    }
+    add_voice(src);
+  }
+  src->start_time = time;
   src->state = CM_STATE_PLAYING;
-  if (!src->active) {
-    src->active = 1;
-    src->next = cmixer.sources;
-    cmixer.sources = src;
+  unlock();
+}
+
+
+cm_UInt64 cm_get_clock(void) { // (LS)
+  cm_UInt64 clock;
+  int seq;
+  do {
+    seq = SDL_AtomicGet(&cmixer.clock_seq);
+    SDL_MemoryBarrierAcquire();
+    clock = cmixer.clock;
+    SDL_MemoryBarrierAcquire();
+  } while ((seq & 1) || seq != SDL_AtomicGet(&cmixer.clock_seq));
+  return clock;
+}
+
+
+/******************************************************************************
+** Queues (LS)
+******************************************************************************/
+
+/* Decode the start of a source that isn't playing, so it can start without
+** stalling the audio thread. A stream that has been played before rewinds on
+** its I/O thread; it is left to rewind again when it starts, so the mixer
+** holds it until the start is there instead of playing silence */
+static void preroll_source(cm_Source *src) {
+  cm_Event e;
+  e.type = CM_EVENT_REWIND;
+  e.udata = src->udata;
+  src->handler(&e);
+  src->position = 0;
+  src->end = first_pass(src);
+  if (!source_ready(src, src->ring / 2)) {
+    src->nextfill = 0;
+    src->rewind = 1;
+    return;
+  }
+  fill_source_buffer(src, 0, src->ring / 2);
+  src->nextfill = src->ring / 2;
+  src->rewind = 0;
+}
+
+
+void cm_set_next(cm_Source *src, cm_Source *next, double crossfade) {
+  if (next) {
+    if (next->voice >= 0 || next == src) {
+      error("the next source must not be playing");
+      return;
+    }
+    preroll_source(next);
   }
+  lock();
+  src->next = next;
+  src->crossfade = MAX(crossfade, 0.0) * cmixer.samplerate;
   unlock();
 }
 
 
+/* Start the next source of every voice that ends within this block (or the
+** crossfade after it) at the frame it ends */
+static void start_queued(int frames) {
+  cm_Voices *vs = &cmixer.voices;
+  int v, count = vs->count, fade;
+  cm_Int64 position, end, remaining;
+  cm_Source *src, *next;
+
+  for (v = 0; v < count; v++) {
+    src = vs->src[v];
+    next = src->next;
+    if (!next || next->voice >= 0 || src->loop || src->state != CM_STATE_PLAYING) {
+      continue;
+    }
+    /* Frames until the play-through ends at the current rate */
+    position = src->rewind ? 0 : vs->position[v];
+    end = src->rewind ? first_pass(src) : vs->end[v];
+    if (src->seek >= 0) {
+      position = (cm_Int64) src->seek << POS_BITS;
+      end = first_pass(src);
+    }
+    remaining = (((end << POS_BITS) - position) + src->rate - 1) / src->rate;
+    if (src->start_time > cmixer.clock) {
+      remaining += src->start_time - cmixer.clock;
+    }
+    fade = MIN(src->crossfade, remaining);
+    if (remaining - fade >= frames) {
+      continue;
+    }
+    if (vs->count == CM_MAX_VOICES) {
+      error("too many active sources");
+      continue;
+    }
+    add_voice(next);
+    next->start_time = cmixer.clock + remaining - fade;
+    next->state = CM_STATE_PLAYING;
+    if (fade > 0) {
+      src->xfade = -1;
+      next->xfade = 1;
+      src->xfade_start = next->xfade_start = next->start_time;
+      src->xfade_len = next->xfade_len = fade;
+    }
+  }
+}
+
+
 void cm_pause(cm_Source *src) {
   src->state = CM_STATE_PAUSED;
 }
@@ -670,6 +2979,58 @@ void cm_pause(cm_Source *src) {
 void cm_stop(cm_Source *src) {
   src->state = CM_STATE_STOPPED;
   src->rewind = 1;
+  src->seek = -1;
+}
+
+
+/* (LS) The seek is done by whoever mixes the source next, like a rewind, so
+** the decoder is only ever used from one thread at a time */
+void cm_seek(cm_Source *src, double position) {
+  int frame = position * src->samplerate;
+  lock();
+  src->seek = MAX(0, MIN(frame, src->length - 1));
+  unlock();
+}
+
+
+/* (LS) `index` must stay valid as long as the source exists. The handler
+** may wait for the I/O thread, so it takes the lock itself where it needs to */
+void cm_set_seek_index(cm_Source *src, const cm_SeekPoint *index, int count) {
+  cm_Event e;
+  e.type = CM_EVENT_INDEX;
+  e.udata = src->udata;
+  e.index = index;
+  e.length = count;
+  src->handler(&e);
+}
+
+
+/* (LS) `mipmap` must be built from the sound the source plays and stay valid
+** as long as the source exists; streams can't use one. A voice reading a
+** level when it changes goes back to the sound itself and picks its level
+** again when next mixed */
+void cm_set_mipmap(cm_Source *src, const cm_Mipmap *mipmap) {
+  if (mipmap && (mipmap->channels != src->channels || mipmap->length != src->length)) {
+    error("mipmap doesn't match the source");
+    return;
+  }
+#ifdef CM_USE_STB_VORBIS
+  if (mipmap && src->handler == stream_handler) {
+    error("streams can't use a mipmap");
+    return;
+  }
+#endif
+  lock();
+  src->mipmap = mipmap;
+  if (src->voice >= 0 && cmixer.voices.level[src->voice]) {
+    set_level(src->voice, 0);
+  } else if (src->voice < 0 && src->level) {
+    src->level = 0;
+    if (src->seek < 0 && !src->rewind) {
+      src->seek = unwrap_frame(src, src->position >> POS_BITS);
+    }
+  }
+  unlock();
 }
 
 
@@ -679,31 +3040,42 @@ void cm_stop(cm_Source *src) {
 
 typedef struct {
   void *data;
+  int format;     /* 1 integer PCM, 3 float (LS) */
   int bitdepth;
   int samplerate;
   int channels;
+  cm_UInt32 mask; /* Speaker of each channel, 0 if not given (LS) */
   int length;
+  int loop_start, loop_end; /* First loop of the smpl subchunk, `loop_end` 0 if none (LS) */
 } Wav;
 
 typedef struct {
   Wav wav;
   void *data;
+  cm_Int16 *pcm; /* Converted data, if the format needed it (LS) */
   int idx;
+  int loop_start, loop_end; /* Loop region in use (LS) */
 } WavStream;
 
 
 static char* find_subchunk(char *data, int len, char *id, int *size) {
-  /* TODO : Error handling on malformed wav file */
+  /* A chunk running past the end of the file ends the search, unless it is
+  ** the one asked for, which is cut to what is there (LS) */
   int idlen = strlen(id);
-  char *p = data + 12;
-next:
-  *size = *((cm_UInt32*) (p + 4));
-  if (memcmp(p, id, idlen)) {
-    p += 8 + *size;
-    if (p > data + len) return NULL;
-    goto next;
+  int pos = 12;
+  cm_UInt32 sz;
+  while (pos <= len - 8) {
+    sz = *((cm_UInt32*) (data + pos + 4));
+    if (!memcmp(data + pos, id, idlen)) {
+      *size = MIN(sz, (cm_UInt32) (len - pos - 8));
+      return data + pos + 8;
+    }
+    if (sz >= (cm_UInt32) (len - pos - 8)) {
+      return NULL;
+    }
+    pos += 8 + sz + (sz & 1);
   }
-  return p + 8;
+  return NULL;
 }
 
 
@@ -714,7 +3086,7 @@ static const char* read_wav(Wav *w, void *data, int len) {
   memset(w, 0, sizeof(*w));
 
   /* Check header */
-  if (memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
+  if (len < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
     return error("bad wav header");
   }
   /* Find fmt subchunk */
@@ -722,18 +3094,33 @@ static const char* read_wav(Wav *w, void *data, int len) {
   if (!p) {
     return error("no fmt subchunk");
   }
+  if (sz < 16) {
+    return error("bad format");
+  }
 
   /* Load fmt info */
   format      = *((cm_UInt16*) (p));
   channels    = *((cm_UInt16*) (p + 2));
   samplerate  = *((cm_UInt32*) (p + 4));
   bitdepth    = *((cm_UInt16*) (p + 14));
-  if (format != 1) {
+  /* WAVE_FORMAT_EXTENSIBLE keeps the actual format at the start of its sub
+  ** format GUID, and a channel mask naming the speakers (LS) */
+  if (format == 0xfffe) {
+    if (sz < 40) {
+      return error("bad format");
+    }
+    w->mask = *((cm_UInt32*) (p + 20));
+    format  = *((cm_UInt16*) (p + 24));
+  }
+  if (format != 1 && format != 3) {
     return error("unsupported format");
   }
-  if (channels == 0 || samplerate == 0 || bitdepth == 0) {
+  if (channels == 0 || samplerate == 0 || bitdepth == 0 || bitdepth % 8) {
     return error("bad format");
   }
+  if (format == 3 ? (bitdepth != 32 && bitdepth != 64) : bitdepth > 32) {
+    return error("unsupported format");
+  }
 
   /* Find data subchunk */
   p = find_subchunk(data, len, "data", &sz);
@@ -743,19 +3130,163 @@ static const char* read_wav(Wav *w, void *data, int len) {
 
   /* Init struct */
   w->data = (void*) p;
+  w->format = format;
   w->samplerate = samplerate;
   w->channels = channels;
   w->length = (sz / (bitdepth / 8)) / channels;
   w->bitdepth = bitdepth;
+
+  /* Find the loop of a sampler subchunk, whose end frame is inclusive (LS) */
+  p = find_subchunk(data, len, "smpl", &sz);
+  if (p && sz >= 60 && *((cm_UInt32*) (p + 28)) > 0) {
+    cm_UInt32 start = *((cm_UInt32*) (p + 44));
+    cm_UInt32 end = *((cm_UInt32*) (p + 48)) + 1;
+    if (start < end && end <= (cm_UInt32) w->length) {
+      w->loop_start = start;
+      w->loop_end = end;
+    }
+  }
   /* Done */
   return NULL;
 }
 
 
+/* (LS) Everything but 8 and 16bit mono or stereo is converted once at load to
+** 16bit, with more than two channels folded down to stereo. The conversion
+** runs through a float block in plain loops the compiler can vectorize. */
+
+#define WAV_BLOCK 1024
+
+static void wav_to_float(const Wav *w, int frame, int frames, float *out) {
+  int i, n = frames * w->channels;
+  const cm_UInt8 *p = (const cm_UInt8*) w->data + frame * w->channels * (w->bitdepth / 8);
+  if (w->format == 3 && w->bitdepth == 32) {
+    memcpy(out, p, n * sizeof(float));
+  } else if (w->format == 3) {
+    for (i = 0; i < n; i++) {
+      double x;
+      memcpy(&x, p + i * 8, 8);
+      out[i] = x;
+    }
+  } else if (w->bitdepth == 8) {
+    for (i = 0; i < n; i++) {
+      out[i] = (p[i] - 128) * (1.0f / 128);
+    }
+  } else if (w->bitdepth == 16) {
+    for (i = 0; i < n; i++) {
+      out[i] = ((const cm_Int16*) p)[i] * (1.0f / 32768);
+    }
+  } else if (w->bitdepth == 24) {
+    for (i = 0; i < n; i++) {
+      cm_UInt32 x = (p[i * 3] << 8) | (p[i * 3 + 1] << 16) | ((cm_UInt32) p[i * 3 + 2] << 24);
+      out[i] = (int) x * (1.0f / 2147483648.0f);
+    }
+  } else {
+    for (i = 0; i < n; i++) {
+      cm_UInt32 x = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) | ((cm_UInt32) p[i * 4 + 3] << 24);
+      out[i] = (int) x * (1.0f / 2147483648.0f);
+    }
+  }
+}
+
+
+static void wav_fold_gains(const Wav *w, float *gl, float *gr) {
+  /* Speakers in channel order, without a mask the usual order for the channel
+  ** count is assumed. Centre and surround speakers go in at -3 dB, LFE is
+  ** dropped and channels beyond the mask are treated as centre */
+  static const cm_UInt32 masks[] = { 0x7, 0x33, 0x37, 0x3f, 0x13f, 0x63f };
+  const cm_UInt32 left = 0x9251, right = 0x244a2;
+  cm_UInt32 mask = w->mask;
+  cm_UInt32 bit = 1;
+  int c;
+  if (!mask && w->channels <= 8) {
+    mask = masks[w->channels - 3];
+  }
+  for (c = 0; c < w->channels; c++) {
+    while (bit && !(mask & bit)) {
+      bit <<= 1;
+    }
+    gl[c] = (bit & left) ? 0.7071f : (bit & right) ? 0 : 0.7071f;
+    gr[c] = (bit & right) ? 0.7071f : (bit & left) ? 0 : 0.7071f;
+    if (bit == 0x1) gl[c] = 1;
+    if (bit == 0x2) gr[c] = 1;
+    if (bit == 0x8) gl[c] = gr[c] = 0;
+    bit <<= 1;
+  }
+}
+
+
+static int wav_needs_convert(const Wav *w) {
+  return w->format != 1 || w->channels > 2 || (w->bitdepth != 16 && w->bitdepth != 8);
+}
+
+
+/* (LS) Read `n` frames from `frame` on into `tmp` as floats, folded down to
+** stereo with the gains `gl` and `gr` if there are more than two channels */
+static void wav_fold_block(const Wav *w, int frame, int n, float *tmp, const float *gl, const float *gr) {
+  int i, c, chans = w->channels;
+  wav_to_float(w, frame, n, tmp);
+  if (chans > 2) {
+    /* Fold down into the two spare block rows at the end */
+    float *l = tmp + WAV_BLOCK * chans, *r = l + WAV_BLOCK;
+    for (i = 0; i < n; i++) {
+      l[i] = r[i] = 0;
+    }
+    for (c = 0; c < chans; c++) {
+      for (i = 0; i < n; i++) {
+        l[i] += tmp[i * chans + c] * gl[c];
+        r[i] += tmp[i * chans + c] * gr[c];
+      }
+    }
+    for (i = 0; i < n; i++) {
+      tmp[i * 2] = l[i];
+      tmp[i * 2 + 1] = r[i];
+    }
+  }
+}
+
+
+/* (LS) Convert to 16-bit, folding more than two channels down to stereo.
+** Float data and fold-downs beyond full scale are clipped like any other
+** sample; returns how many samples were, or -1 if out of memory */
+static int wav_convert(const Wav *w, cm_Int16 *out) {
+  int i, frame, n, clipped = 0;
+  int chans = w->channels;
+  int outchans = MIN(chans, 2);
+  float *tmp = malloc(sizeof(float) * WAV_BLOCK * (chans + 2));
+  float *gl = malloc(sizeof(float) * chans * 2), *gr;
+  if (!tmp || !gl) {
+    free(tmp);
+    free(gl);
+    return -1;
+  }
+  gr = gl + chans;
+  if (chans > 2) {
+    wav_fold_gains(w, gl, gr);
+  }
+
+  for (frame = 0; frame < w->length; frame += n) {
+    n = MIN(WAV_BLOCK, w->length - frame);
+    wav_fold_block(w, frame, n, tmp, gl, gr);
+    for (i = 0; i < n * outchans; i++) {
+      float x = tmp[i] * 32768.0f;
+      /* Full scale 1.0 is only one step out, so it doesn't count */
+      clipped += x < -32768.5f || x > 32768.5f;
+      x = x < -32768.0f ? -32768.0f : x > 32767.0f ? 32767.0f : x;
+      out[frame * outchans + i] = (cm_Int16) (x < 0 ? x - 0.5f : x + 0.5f);
+    }
+  }
+
+  free(tmp);
+  free(gl);
+  return clipped;
+}
+
+
 #define WAV_PROCESS_LOOP(X) \
   while (n--) {             \
     X                       \
-    dst += 2;               \
+    dst += s->wav.channels; \
     s->idx++;               \
   }
 
@@ -769,18 +3300,19 @@ static void wav_handler(cm_Event *e) {
 
     case CM_EVENT_DESTROY:
       free(s->data);
+      free(s->pcm);
       free(s);
       break;
 
     case CM_EVENT_SAMPLES:
       dst = e->buffer;
-      len = e->length / 2;
+      len = e->length / s->wav.channels;
 fill:
-      n = MIN(len, s->wav.length - s->idx);
+      n = MAX(0, MIN(len, (s->loop_end ? s->loop_end : s->wav.length) - s->idx));
       len -= n;
       if (s->wav.bitdepth == 16 && s->wav.channels == 1) {
         WAV_PROCESS_LOOP({
-          dst[0] = dst[1] = ((cm_Int16*) s->wav.data)[s->idx];
+          dst[0] = ((cm_Int16*) s->wav.data)[s->idx];
         });
       } else if (s->wav.bitdepth == 16 && s->wav.channels == 2) {
         WAV_PROCESS_LOOP({
@@ -790,7 +3322,7 @@ fill:
         });
       } else if (s->wav.bitdepth == 8 && s->wav.channels == 1) {
         WAV_PROCESS_LOOP({
-          dst[0] = dst[1] = (((cm_UInt8*) s->wav.data)[s->idx] - 128) << 8;
+          dst[0] = (((cm_UInt8*) s->wav.data)[s->idx] - 128) << 8;
         });
       } else if (s->wav.bitdepth == 8 && s->wav.channels == 2) {
         WAV_PROCESS_LOOP({
@@ -801,7 +3333,7 @@ fill:
       }
       /* Loop back and continue filling buffer if we didn't fill the buffer */
       if (len > 0) {
-        s->idx = 0;
+        s->idx = s->loop_end ? s->loop_start : 0;
         goto fill;
       }
       break;
@@ -809,6 +3341,20 @@ fill:
     case CM_EVENT_REWIND:
       s->idx = 0;
       break;
+
+    case CM_EVENT_SEEK:
+      s->idx = e->length;
+      break;
+
+    case CM_EVENT_LOOP:
+      if (e->length == -1) {
+        e->start = s->wav.loop_start;
+        e->length = s->wav.loop_end;
+        break;
+      }
+      s->loop_start = e->start;
+      s->loop_end = e->length;
+      break;
   }
 }
 
@@ -822,31 +3368,73 @@ static const char* wav_init(cm_SourceInfo *info, void *data, int len, int ownsda
     return err;
   }
 
-  if (wav.channels > 2 || (wav.bitdepth != 16 && wav.bitdepth != 8)) {
-    return error("unsupported wav format");
-  }
-
   stream = calloc(1, sizeof(*stream));
   if (!stream) {
     return error("allocation failed");
   }
-  stream->wav = wav;
 
   if (ownsdata) {
     stream->data = data;
   }
+  if (wav_needs_convert(&wav)) {
+    /* Into 16bit mono or stereo (LS) */
+    int chans = MIN(wav.channels, 2);
+    stream->pcm = malloc(sizeof(cm_Int16) * wav.length * chans + 1);
+    if (!stream->pcm || wav_convert(&wav, stream->pcm) < 0) {
+      free(stream->pcm);
+      free(stream);
+      return error("allocation failed");
+    }
+    wav.data = stream->pcm;
+    wav.format = 1;
+    wav.bitdepth = 16;
+    wav.channels = chans;
+  }
+  stream->wav = wav;
   stream->idx = 0;
 
   info->udata = stream;
   info->handler = wav_handler;
   info->samplerate = wav.samplerate;
   info->length = wav.length;
+  info->channels = wav.channels;
 
   /* Return NULL (no error) for success */
   return NULL;
 }
 
 
+/* (LS) `clipped` receives the number of samples clipped, if not NULL */
+void* cm_convert_wav(void *data, int size, int *outsize, int *clipped) { // (LS)
+  Wav wav;
+  char *out;
+  int chans, bytes, n = -1;
+
+  if (!check_header(data, size, "WAVE", 8) || read_wav(&wav, data, size) ||
+      !wav_needs_convert(&wav)
+  ) {
+    return NULL;
+  }
+  chans = MIN(wav.channels, 2);
+  bytes = wav.length * chans * 2;
+  *outsize = 44 + bytes + (wav.loop_end ? 68 : 0);
+  out = malloc(*outsize);
+  if (!out || (n = wav_convert(&wav, (cm_Int16*) (out + 44))) < 0) {
+    free(out);
+    error("allocation failed");
+    return NULL;
+  }
+  if (clipped) {
+    *clipped = n;
+  }
+  put_wav_header(out, wav.length, chans, wav.samplerate, *outsize);
+  if (wav.loop_end) {
+    put_smpl_chunk(out + 44 + bytes, wav.samplerate, wav.loop_start, wav.loop_end);
+  }
+  return out;
+}
+
+
 /*============================================================================
 ** Ogg stream
 **============================================================================*/
@@ -856,10 +3444,128 @@ static const char* wav_init(cm_SourceInfo *info, void *data, int len, int ownsda
 #define STB_VORBIS_HEADER_ONLY
 #include "stb_vorbis.c"
 
-typedef struct {
+typedef struct OggStream OggStream;
+
+struct OggStream {
   stb_vorbis *ogg;
   void *data;
-} OggStream;
+  int channels;         /* Channels decoded, 1 for mono files and 2 for all others (LS) */
+  // (LS) loop region, see `loop_ogg()`:
+  unsigned char *mem;   /* The encoded file */
+  int size;
+  int pos;              /* Frame `ogg` decodes next */
+  int file_start, file_end; /* Loop region of the comments, `file_end` 0 if none */
+  int loop_start, loop_end; /* Loop region in use */
+  stb_vorbis *spare;    /* Second decoder the I/O thread keeps at the loop start */
+  SDL_atomic_t ready;   /* Set once `spare` is at the loop start */
+  const cm_SeekPoint *index;
+  int points;
+  OggStream *next;      /* Next stream with a spare decoder */
+};
+
+static void streamer_add_loop(OggStream *s);
+static void streamer_remove_loop(OggStream *s);
+static void streamer_lock(void);
+static void streamer_unlock(void);
+
+
+/* (LS) Decode up to `frames` frames of `channels` into `buf`. Mono and stereo
+** files are converted straight out of the decoder's planar float buffers by
+** stb_vorbis' SIMD converter; stb_vorbis folds the others down to stereo.
+** The ring stays 16-bit, as the interpolators read across decoder frames and
+** a float ring would double its memory and every render kernel */
+static int ogg_read(stb_vorbis *ogg, int channels, cm_Int16 *buf, int frames) {
+  float **pcm;
+  int k, n = 0;
+  if (stb_vorbis_get_info(ogg).channels > 2) {
+    return stb_vorbis_get_samples_short_interleaved(ogg, channels, buf, frames * channels);
+  }
+  while (n < frames && (k = stb_vorbis_get_samples_float_pointers(ogg, &pcm, frames - n))) {
+    stb_vorbis_convert_short_interleaved(channels, buf, pcm, k);
+    buf += k * channels;
+    n += k;
+  }
+  return n;
+}
+
+
+/* (LS) Read the loop region from LOOPSTART and LOOPLENGTH or LOOPEND comments */
+static void ogg_loop_comments(stb_vorbis *ogg, int length, int *start, int *end) {
+  stb_vorbis_comment c = stb_vorbis_get_comment(ogg);
+  int i, j, loop_start = -1, loop_length = -1, loop_end = -1;
+  char key[16];
+  const char *value;
+  for (i = 0; i < c.comment_list_length; i++) {
+    value = strchr(c.comment_list[i], '=');
+    if (!value || value - c.comment_list[i] >= (int) sizeof(key)) {
+      continue;
+    }
+    for (j = 0; c.comment_list[i] + j < value; j++) {
+      key[j] = toupper((unsigned char) c.comment_list[i][j]);
+    }
+    key[j] = '\0';
+    if (!strcmp(key, "LOOPSTART")) {
+      loop_start = atoi(value + 1);
+    } else if (!strcmp(key, "LOOPLENGTH")) {
+      loop_length = atoi(value + 1);
+    } else if (!strcmp(key, "LOOPEND")) {
+      loop_end = atoi(value + 1);
+    }
+  }
+  if (loop_length > 0) {
+    loop_end = loop_start + loop_length;
+  }
+  if (loop_end < 0 || loop_end > length) {
+    loop_end = length;
+  }
+  *start = *end = 0;
+  if (loop_start >= 0 && loop_start < loop_end) {
+    *start = loop_start;
+    *end = loop_end;
+  }
+}
+
+
+/* (LS) Continue at the loop start. The spare decoder has been moved there by
+** the I/O thread, so the wrap neither seeks nor decodes more than usual, and
+** the old decoder becomes the spare */
+static void loop_ogg(OggStream *s) {
+  stb_vorbis *ogg = s->ogg;
+  if (SDL_AtomicGet(&s->ready)) {
+    s->ogg = s->spare;
+    s->spare = ogg;
+    SDL_AtomicSet(&s->ready, 0);
+  } else {
+    /* The I/O thread fell behind, which only happens with very short loops */
+    stb_vorbis_seek(s->ogg, s->loop_start);
+  }
+  s->pos = s->loop_start;
+}
+
+
+static void set_ogg_loop(OggStream *s, int start, int end) {
+  int err;
+  if (end && !s->spare) {
+    s->spare = stb_vorbis_open_memory(s->mem, s->size, &err, NULL);
+    if (!s->spare) {
+      start = end = 0;
+    } else if (s->index) {
+      stb_vorbis_set_page_index(s->spare, (const stb_vorbis_page*) s->index, s->points);
+    }
+  }
+  if (s->loop_end) {
+    streamer_remove_loop(s);
+  }
+  s->loop_start = start;
+  s->loop_end = end;
+  SDL_AtomicSet(&s->ready, 0);
+  if (s->loop_end) {
+    streamer_add_loop(s);
+  } else if (s->spare) {
+    stb_vorbis_close(s->spare);
+    s->spare = NULL;
+  }
+}
 
 
 static void ogg_handler(cm_Event *e) {
@@ -870,6 +3576,12 @@ static void ogg_handler(cm_Event *e) {
   switch (e->type) {
 
     case CM_EVENT_DESTROY:
+      if (s->loop_end) {
+        streamer_remove_loop(s);
+      }
+      if (s->spare) {
+        stb_vorbis_close(s->spare);
+      }
       stb_vorbis_close(s->ogg);
       free(s->data);
       free(s);
@@ -879,12 +3591,22 @@ static void ogg_handler(cm_Event *e) {
       len = e->length;
       buf = e->buffer;
 fill:
-      n = stb_vorbis_get_samples_short_interleaved(s->ogg, 2, buf, len);
-      n *= 2;
+      n = len;
+      if (s->loop_end) {
+        n = MAX(0, MIN(n, (s->loop_end - s->pos) * s->channels));
+      }
+      n = ogg_read(s->ogg, s->channels, buf, n / s->channels);
+      s->pos += n;
+      n *= s->channels;
       /* rewind and fill remaining buffer if we reached the end of the ogg
-      ** before filling it */
+      ** (or the loop, LS) before filling it */
       if (len != n) {
-        stb_vorbis_seek_start(s->ogg);
+        if (s->loop_end && s->pos >= s->loop_end) {
+          loop_ogg(s);
+        } else {
+          stb_vorbis_seek_start(s->ogg);
+          s->pos = 0;
+        }
         buf += n;
         len -= n;
         goto fill;
@@ -893,6 +3615,43 @@ fill:
 
     case CM_EVENT_REWIND:
       stb_vorbis_seek_start(s->ogg);
+      s->pos = 0;
+      break;
+
+    case CM_EVENT_SEEK:
+      stb_vorbis_seek(s->ogg, e->length);
+      s->pos = e->length;
+      break;
+
+    case CM_EVENT_INDEX: /* cm_SeekPoint has the layout of stb_vorbis_page */
+      /* The I/O thread uses the spare and the audio thread the other decoder,
+      ** which it may swap; the I/O thread is waited for before the audio
+      ** thread is locked out, never the other way round */
+      if (s->spare) {
+        streamer_lock();
+      }
+      lock();
+      s->index = e->index;
+      s->points = e->length;
+      stb_vorbis_set_page_index(s->ogg, (const stb_vorbis_page*) e->index, e->length);
+      if (s->spare) {
+        stb_vorbis_set_page_index(s->spare, (const stb_vorbis_page*) e->index, e->length);
+      }
+      unlock();
+      if (s->spare) {
+        streamer_unlock();
+      }
+      break;
+
+    case CM_EVENT_LOOP:
+      if (e->length == -1) {
+        e->start = s->file_start;
+        e->length = s->file_end;
+        break;
+      }
+      set_ogg_loop(s, e->start, e->length);
+      e->start = s->loop_start;
+      e->length = s->loop_end;
       break;
   }
 }
@@ -920,17 +3679,440 @@ static const char* ogg_init(cm_SourceInfo *info, void *data, int len, int ownsda
   if (ownsdata) {
     stream->data = data;
   }
+  stream->mem = data;
+  stream->size = len;
 
   ogginfo = stb_vorbis_get_info(ogg);
+  stream->channels = ogginfo.channels == 1 ? 1 : 2;
 
   info->udata = stream;
   info->handler = ogg_handler;
   info->samplerate = ogginfo.sample_rate;
+  info->channels = stream->channels;
   info->length = stb_vorbis_stream_length_in_samples(ogg);
+  ogg_loop_comments(ogg, info->length, &stream->file_start, &stream->file_end);
 
   /* Return NULL (no error) for success */
   return NULL;
 }
 
 
+/* (LS) Seek index of an ogg file: its pages are scanned once, so seeking
+** later reads a single page instead of bisecting the file */
+static cm_SeekPoint* build_seek_index(stb_vorbis *ogg, int *count) {
+  cm_SeekPoint *index;
+  int n = stb_vorbis_build_page_index(ogg, NULL, 0);
+  index = malloc(MAX(n, 1) * sizeof(*index));
+  if (!index) {
+    error("allocation failed");
+    return NULL;
+  }
+  *count = stb_vorbis_build_page_index(ogg, (stb_vorbis_page*) index, n);
+  return index;
+}
+
+
+cm_SeekPoint* cm_build_seek_index(void *data, int size, int *count) {
+  cm_SeekPoint *index;
+  stb_vorbis *ogg;
+  int err;
+  ogg = stb_vorbis_open_memory(data, size, &err, NULL);
+  if (!ogg) {
+    error("invalid ogg data");
+    return NULL;
+  }
+  index = build_seek_index(ogg, count);
+  stb_vorbis_close(ogg);
+  return index;
+}
+
+
+cm_SeekPoint* cm_build_seek_index_from_file(const char *filename, int *count) {
+  cm_SeekPoint *index;
+  stb_vorbis *ogg;
+  int err;
+  ogg = stb_vorbis_open_filename(filename, &err, NULL);
+  if (!ogg) {
+    error("could not open ogg file");
+    return NULL;
+  }
+  index = build_seek_index(ogg, count);
+  stb_vorbis_close(ogg);
+  return index;
+}
+
+
+/*============================================================================
+** Ogg file stream (LS)
+**============================================================================*/
+
+/* Streams decode an ogg file a little ahead into a ring of PCM on a shared
+** I/O thread, so neither the encoded file nor disk access and decoding ever
+** reach the audio thread. Like `ogg_handler` the ring holds the file looped
+** over and over. A rewind, seek or loop change asks the I/O thread to decode
+** from the start or the seek target again and wakes it, until which the
+** stream holds its position; a stream that has not been read from is already
+** at the start, so starting a stream is seamless.
+**
+** The ring has a single writer (the I/O thread) and a single reader (the
+** audio thread, or whoever prerolls a source that isn't playing). With a loop
+** region the I/O thread seeks back to the loop start when it has decoded the
+** loop end, so the ring holds the wrap like any other frames.
+**
+** The I/O thread also keeps the spare decoders of in-memory oggs with a loop
+** region at the loop start (see `loop_ogg()`). */
+
+#define STREAM_FRAMES     (1 << 15)     /* Size of the ring */
+#define STREAM_MASK       (STREAM_FRAMES - 1)
+#define STREAM_CHUNK      (1024)        /* Frames decoded at a time */
+#define STREAM_PERIOD     (10)          /* Milliseconds the I/O thread sleeps between top ups */
+
+typedef struct OggFileStream OggFileStream;
+
+struct OggFileStream {
+  stb_vorbis *ogg;
+  int channels;                 /* 1 for mono files, 2 for all others */
+  cm_Int16 *pcm;                /* Ring of STREAM_FRAMES frames of `channels` */
+  SDL_atomic_t write;           /* Frames written to the ring, wrapping */
+  SDL_atomic_t read;            /* Frames read from the ring, wrapping */
+  SDL_atomic_t rewind;          /* Counts rewinds and seeks until the I/O thread has done them */
+  int target;                   /* Frame to decode from after them */
+  int length;                   /* Length of the file in frames */
+  int consumed;                 /* Frames read since the start of the file */
+  int decoded;                  /* Frame the decoder is at */
+  int file_start, file_end;     /* Loop region of the comments, `file_end` 0 if none */
+  int loop_start, loop_end;     /* Loop region in use */
+  OggFileStream *next;          /* Next stream of the I/O thread */
+};
+
+static struct {
+  SDL_mutex *mutex;             /* Guards the lists against the I/O thread */
+  SDL_sem *wake;                /* Posted to have the I/O thread look at the streams early */
+  SDL_Thread *thread;
+  SDL_atomic_t quit;
+  OggFileStream *list;
+  OggStream *loops;             /* In-memory oggs with a spare decoder */
+} streamer;
+
+
+/* Decode into the free part of the ring, at most `max` frames */
+static void stream_decode(OggFileStream *s, int max) {
+  int w, n, len, retry = 0;
+  w = SDL_AtomicGet(&s->write);
+  while (max > 0) {
+    len = MIN(STREAM_FRAMES - (w - SDL_AtomicGet(&s->read)), max);
+    len = MIN(len, STREAM_CHUNK);
+    len = MIN(len, STREAM_FRAMES - (w & STREAM_MASK));
+    if (len <= 0) {
+      break;
+    }
+    if (s->loop_end) {
+      if (s->decoded >= s->loop_end) {
+        stb_vorbis_seek(s->ogg, s->loop_start);
+        s->decoded = s->loop_start;
+      }
+      len = MIN(len, s->loop_end - s->decoded);
+    }
+    n = ogg_read(s->ogg, s->channels, s->pcm + (w & STREAM_MASK) * s->channels, len);
+    if (n == 0) {
+      /* Continue from the start at the end of the file */
+      if (retry++) {
+        break;
+      }
+      stb_vorbis_seek_start(s->ogg);
+      s->decoded = 0;
+      continue;
+    }
+    retry = 0;
+    s->decoded += n;
+    w += n;
+    max -= n;
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&s->write, w);
+  }
+}
+
+
+static int stream_thread(void *udata) {
+  OggFileStream *s;
+  OggStream *o;
+  int r;
+  UNUSED(udata);
+  while (!SDL_AtomicGet(&streamer.quit)) {
+    SDL_LockMutex(streamer.mutex);
+    for (s = streamer.list; s; s = s->next) {
+      r = SDL_AtomicGet(&s->rewind);
+      if (r) {
+        if (s->target > 0) {
+          stb_vorbis_seek(s->ogg, s->target);
+        } else {
+          stb_vorbis_seek_start(s->ogg);
+        }
+        s->decoded = s->target;
+        SDL_AtomicSet(&s->write, SDL_AtomicGet(&s->read));
+        stream_decode(s, STREAM_FRAMES / 4);
+        /* Done unless another rewind or seek came in meanwhile */
+        SDL_AtomicCAS(&s->rewind, r, 0);
+      }
+      stream_decode(s, STREAM_FRAMES);
+    }
+    for (o = streamer.loops; o; o = o->next) {
+      if (!SDL_AtomicGet(&o->ready)) {
+        stb_vorbis_seek(o->spare, o->loop_start);
+        SDL_AtomicSet(&o->ready, 1);
+      }
+    }
+    SDL_UnlockMutex(streamer.mutex);
+    SDL_SemWaitTimeout(streamer.wake, STREAM_PERIOD);
+  }
+  return 0;
+}
+
+
+static void streamer_start(void) {
+  if (!streamer.mutex) {
+    streamer.mutex = SDL_CreateMutex();
+    streamer.wake = SDL_CreateSemaphore(0);
+  }
+  if (!streamer.thread) {
+    SDL_AtomicSet(&streamer.quit, 0);
+    streamer.thread = SDL_CreateThread(stream_thread, "cm_stream", NULL);
+  }
+}
+
+
+/* Stop the I/O thread once it has nothing left to do. Joins it, so this is
+** never called under the mixer's lock */
+static void streamer_stop(void) {
+  if (!streamer.list && !streamer.loops && streamer.thread) {
+    SDL_AtomicSet(&streamer.quit, 1);
+    SDL_SemPost(streamer.wake);
+    SDL_WaitThread(streamer.thread, NULL);
+    streamer.thread = NULL;
+  }
+}
+
+
+static void streamer_lock(void) {
+  SDL_LockMutex(streamer.mutex);
+}
+
+
+static void streamer_unlock(void) {
+  SDL_UnlockMutex(streamer.mutex);
+}
+
+
+static void streamer_add_loop(OggStream *s) {
+  streamer_start();
+  SDL_LockMutex(streamer.mutex);
+  s->next = streamer.loops;
+  streamer.loops = s;
+  SDL_UnlockMutex(streamer.mutex);
+}
+
+
+static void streamer_remove_loop(OggStream *s) {
+  OggStream **p;
+  SDL_LockMutex(streamer.mutex);
+  for (p = &streamer.loops; *p != s; p = &(*p)->next);
+  *p = s->next;
+  SDL_UnlockMutex(streamer.mutex);
+  streamer_stop();
+}
+
+
+/* Switch to a new loop region. What has been decoded ahead is kept if the
+** ring holds the file from `consumed` on without a wrap and stops short of
+** the new loop end; otherwise it is decoded again from `consumed`, which the
+** I/O thread does like a seek. Waits for the I/O thread's current pass, so
+** this must not run under the mixer's lock */
+static void set_stream_loop(OggFileStream *s, int start, int end) {
+  int keep;
+  SDL_LockMutex(streamer.mutex);
+  keep = !SDL_AtomicGet(&s->rewind) &&
+         s->decoded - s->consumed == SDL_AtomicGet(&s->write) - SDL_AtomicGet(&s->read) &&
+         (!end || s->decoded <= end);
+  s->loop_start = start;
+  s->loop_end = end;
+  if (!keep) {
+    if (s->loop_end && s->consumed >= s->loop_end) {
+      s->consumed = s->loop_start + (s->consumed - s->loop_start) % (s->loop_end - s->loop_start);
+    }
+    s->target = s->consumed;
+    SDL_AtomicAdd(&s->rewind, 1);
+  }
+  SDL_UnlockMutex(streamer.mutex);
+  if (!keep) {
+    SDL_SemPost(streamer.wake);
+  }
+}
+
+
+static void stream_handler(cm_Event *e) {
+  int i, n, r, len, ch;
+  OggFileStream *s = e->udata, **p;
+
+  switch (e->type) {
+
+    case CM_EVENT_DESTROY:
+      SDL_LockMutex(streamer.mutex);
+      for (p = &streamer.list; *p != s; p = &(*p)->next);
+      *p = s->next;
+      SDL_UnlockMutex(streamer.mutex);
+      streamer_stop();
+      stb_vorbis_close(s->ogg);
+      free(s->pcm);
+      free(s);
+      break;
+
+    case CM_EVENT_SAMPLES:
+      ch = s->channels;
+      len = e->length / ch;
+      n = 0;
+      if (!SDL_AtomicGet(&s->rewind)) {
+        r = SDL_AtomicGet(&s->read);
+        n = MIN(len, SDL_AtomicGet(&s->write) - r);
+        SDL_MemoryBarrierAcquire();
+        /* In two parts where the ring wraps */
+        i = MIN(n, STREAM_FRAMES - (r & STREAM_MASK));
+        memcpy(e->buffer, s->pcm + (r & STREAM_MASK) * ch, i * ch * sizeof(e->buffer[0]));
+        memcpy(e->buffer + i * ch, s->pcm, (n - i) * ch * sizeof(e->buffer[0]));
+        r += n;
+        SDL_AtomicSet(&s->read, r);
+        s->consumed += n;
+        if (s->loop_end && s->consumed >= s->loop_end) {
+          s->consumed = s->loop_start + (s->consumed - s->loop_start) % (s->loop_end - s->loop_start);
+        } else {
+          s->consumed %= s->length;
+        }
+      }
+      /* Silence if the I/O thread fell behind, which the mixer avoids by
+      ** asking with CM_EVENT_READY first */
+      memset(e->buffer + n * ch, 0, (len - n) * ch * sizeof(e->buffer[0]));
+      break;
+
+    case CM_EVENT_REWIND:
+      if (s->consumed != 0) {
+        s->consumed = 0;
+        s->target = 0;
+        SDL_AtomicAdd(&s->rewind, 1);
+        SDL_SemPost(streamer.wake);
+      }
+      break;
+
+    case CM_EVENT_SEEK:
+      s->consumed = e->length;
+      s->target = e->length;
+      SDL_AtomicAdd(&s->rewind, 1);
+      SDL_SemPost(streamer.wake);
+      break;
+
+    case CM_EVENT_READY:
+      if (SDL_AtomicGet(&s->rewind)) {
+        e->length = 0;
+      } else {
+        e->length = MIN(e->length, SDL_AtomicGet(&s->write) - SDL_AtomicGet(&s->read));
+      }
+      break;
+
+    case CM_EVENT_INDEX: /* Only the I/O thread uses the decoder */
+      SDL_LockMutex(streamer.mutex);
+      stb_vorbis_set_page_index(s->ogg, (const stb_vorbis_page*) e->index, e->length);
+      SDL_UnlockMutex(streamer.mutex);
+      break;
+
+    case CM_EVENT_LOOP:
+      if (e->length == -1) {
+        e->start = s->file_start;
+        e->length = s->file_end;
+        break;
+      }
+      set_stream_loop(s, e->start, e->length);
+      break;
+  }
+}
+
+
+cm_Source* cm_new_stream_from_file(const char *filename) {
+  OggFileStream *stream;
+  cm_SourceInfo info;
+  stb_vorbis *ogg;
+  cm_Source *src;
+  int err;
+
+  ogg = stb_vorbis_open_filename(filename, &err, NULL);
+  if (!ogg) {
+    error("could not open ogg file");
+    return NULL;
+  }
+  stream = calloc(1, sizeof(*stream));
+  if (stream) {
+    stream->channels = stb_vorbis_get_info(ogg).channels == 1 ? 1 : 2;
+    stream->pcm = malloc(STREAM_FRAMES * stream->channels * sizeof(*stream->pcm));
+  }
+  if (!stream || !stream->pcm) {
+    stb_vorbis_close(ogg);
+    free(stream);
+    error("allocation failed");
+    return NULL;
+  }
+  stream->ogg = ogg;
+  stream->length = MAX(stb_vorbis_stream_length_in_samples(ogg), 1);
+  ogg_loop_comments(ogg, stream->length, &stream->file_start, &stream->file_end);
+  stb_vorbis_seek_start(ogg);
+
+  /* Decode the start right away so the stream can be played at once */
+  stream_decode(stream, STREAM_FRAMES / 4);
+
+  info.udata = stream;
+  info.handler = stream_handler;
+  info.samplerate = stb_vorbis_get_info(ogg).sample_rate;
+  info.length = stream->length;
+  info.channels = stream->channels;
+  src = cm_new_source(&info);
+  if (!src) {
+    stb_vorbis_close(ogg);
+    free(stream->pcm);
+    free(stream);
+    return NULL;
+  }
+
+  /* Hand the stream to the I/O thread */
+  streamer_start();
+  SDL_LockMutex(streamer.mutex);
+  stream->next = streamer.list;
+  streamer.list = stream;
+  SDL_UnlockMutex(streamer.mutex);
+  return src;
+}
+
+
+#else
+
+
+cm_Source* cm_new_stream_from_file(const char *filename) {
+  UNUSED(filename);
+  error("streaming needs stb_vorbis");
+  return NULL;
+}
+
+
+cm_SeekPoint* cm_build_seek_index(void *data, int size, int *count) {
+  UNUSED(data);
+  UNUSED(size);
+  UNUSED(count);
+  error("seek indices need stb_vorbis");
+  return NULL;
+}
+
+
+cm_SeekPoint* cm_build_seek_index_from_file(const char *filename, int *count) {
+  UNUSED(filename);
+  UNUSED(count);
+  error("seek indices need stb_vorbis");
+  return NULL;
+}
+
+
 #endif
@@ -13,17 +13,38 @@
 
 #define BUFFER_SIZE       (512)
 #define BUFFER_MASK       (BUFFER_SIZE - 1)
+#define CM_MAX_RING       (1 << 14) /* Largest source ring in frames, see `cm_set_ring_size()` (LS) */
+#define CM_MIP_LEVELS     (4)  /* Most octave-down copies in a mipmap, see `cm_build_mipmap()` (LS) */
+#define CM_SINC_TAPS      (16) /* Taps of the windowed-sinc interpolator, even and at most 64 (LS) */
+#define CM_MAX_OUTPUTS    (8)  /* Maximum number of output channels (LS) */
+#define CM_MAX_BUSES      (8)  /* Maximum number of submix buses, including the master (LS) */
+#define CM_MASTER_BUS     (0)  /* Bus every source is mixed into by default (LS) */
+#define CM_SPEAKER_NONE   (-1000.0) /* Azimuth of an output channel not used for panning, e.g. the LFE (LS) */
 
 
 typedef short           cm_Int16;
 typedef int             cm_Int32;
 typedef long long       cm_Int64;
+typedef unsigned long long cm_UInt64;
 typedef unsigned char   cm_UInt8;
 typedef unsigned short  cm_UInt16;
 typedef unsigned        cm_UInt32;
 
 typedef struct cm_Source cm_Source;
 
+typedef struct {        /* Page of an ogg file, see `cm_build_seek_index()` (LS) */
+  cm_UInt32 offset;     /* Byte offset of the page in the file */
+  cm_UInt32 sample;     /* Frame the last packet on the page ends at */
+} cm_SeekPoint;
+
+typedef struct {        /* Octave-down copies of a sound, see `cm_build_mipmap()` (LS) */
+  int levels;           /* Number of copies */
+  int channels;         /* Channels per frame, those of the sound */
+  int length;           /* Frames of the sound itself */
+  int frames[CM_MIP_LEVELS];      /* Frames of each copy */
+  cm_Int16 *level[CM_MIP_LEVELS]; /* Copy `i` at 1 / 2^(i + 1) of the sound's rate */
+} cm_Mipmap;
+
 
 
 
@@ -34,6 +55,8 @@ typedef struct {
   const char *msg;
   cm_Int16 *buffer;
   int length;
+  const cm_SeekPoint *index; /* CM_EVENT_INDEX only, with `length` points (LS) */
+  int start;            /* CM_EVENT_LOOP only, the loop end being `length` (LS) */
 } cm_Event;
 
 typedef void (*cm_EventHandler)(cm_Event *e);
@@ -43,6 +66,7 @@ typedef struct {
   void *udata;
   int samplerate;
   int length;
+  int channels;         /* 1 if the handler fills mono samples, otherwise stereo (LS) */
 } cm_SourceInfo;
 
 
@@ -52,33 +76,128 @@ enum {
   CM_STATE_PAUSED
 };
 
+enum {
+  CM_FORMAT_S16,
+  CM_FORMAT_S32,
+  CM_FORMAT_F32
+};
+
+enum {
+  CM_INTERP_LINEAR,
+  CM_INTERP_CUBIC,
+  CM_INTERP_SINC
+};
+
+enum {
+  CM_FDN_OFF,
+  CM_FDN_SEND,          /* Reverberates the send bus */
+  CM_FDN_MASTER         /* Reverberates the whole mix before the master IIR */
+};
+
+enum {
+  CM_ROLLOFF_INVERSE,   /* min / (min + rolloff * (d - min)) */
+  CM_ROLLOFF_LINEAR,    /* 1 - rolloff * (d - min) / (max - min) */
+  CM_ROLLOFF_EXPONENTIAL /* (d / min) ^ -rolloff */
+};
+
+enum {
+  CM_PROF_DECODE,       /* Decoding in the source handlers */
+  CM_PROF_MIX,          /* Resampling, filtering and adding up the voices */
+  CM_PROF_MASTER,       /* Master IIR, gain and clipping */
+  CM_PROF_CALLBACKS,    /* Finished callbacks */
+  CM_PROF_EFFECTS,      /* Reverbs on the send bus and master */
+  CM_PROF_BLOCK,        /* The whole block */
+  CM_PROF_STAGES
+};
+
 enum {
   CM_EVENT_LOCK,
   CM_EVENT_UNLOCK,
   CM_EVENT_DESTROY,
   CM_EVENT_SAMPLES,
-  CM_EVENT_REWIND
+  CM_EVENT_REWIND,
+  CM_EVENT_SEEK,        /* Continue at frame `length` (LS) */
+  CM_EVENT_INDEX,       /* Use the seek index `index` (LS) */
+  CM_EVENT_LOOP,        /* Loop from `start` at `length`; -1 asks for the file's loop (LS) */
+  CM_EVENT_READY        /* Lower `length` to the frames buffered if fewer (LS) */
 };
 
 
+typedef struct {
+  double min, avg, max, p99;    /* Time per block in microseconds */
+} cm_StageStats;
+
+typedef struct {
+  int blocks;                   /* Number of blocks measured */
+  double load;                  /* Share of the real-time budget spent mixing */
+  cm_StageStats stage[CM_PROF_STAGES];
+} cm_Stats;
+
+
+typedef struct {        /* Second order IIR filter (LS) */
+  double xl[2],xr[2];   /* Input history */
+  double yl[2],yr[2];   /* Output history */
+  double a1,a2,b0,b1,b2;
+} cm_Biquad;
+
+
 struct cm_Source {
-  cm_Source *next;              /* Next source in list */
-  cm_Int16 buffer[BUFFER_SIZE]; /* Internal buffer with raw stereo PCM */
+  cm_Int16 *buffer;     /* Internal ring of raw PCM, `ring` frames of `channels` (LS) */
+  cm_Int16 ring_buf[BUFFER_SIZE]; /* Storage of the default ring of BUFFER_SIZE / 2 frames (LS) */
+  int ring;             /* Frames in `buffer`, a power of two, refilled half at a time (LS) */
   cm_EventHandler handler;      /* Event handler */
   void *udata;          /* Stream's udata (from cm_SourceInfo) */
   int samplerate;       /* Stream's native samplerate */
   int length;           /* Stream's length in frames */
+  int channels;         /* 1 for a mono source, 2 for a stereo one (LS) */
+  /* Playback state below is copied into the voice table while the source is
+  ** active and written back when it is removed (see `cmixer.c`) */
   int end;              /* End index for the current play-through */
   int state;            /* Current state (playing|paused|stopped) */
-  cm_Int64 position;    /* Current playhead position (fixed point) */
-  int lgain, rgain;     /* Left and right gain (fixed point) */
-  int rate;             /* Playback rate (fixed point) */
+  cm_Int64 position;    /* Current playhead position (32.32 fixed point) */
+  int nspeakers;        /* Number of output channels the source is mixed into */
+  cm_UInt8 speaker[CM_MAX_OUTPUTS]; /* Output channels the source is mixed into */
+  int lgain[CM_MAX_OUTPUTS];        /* Gain of the left input on each of them (fixed point) */
+  int rgain[CM_MAX_OUTPUTS];        /* Gain of the right input on each of them (fixed point) */
+  cm_Int64 rate;        /* Playback rate (32.32 fixed point) */
+  int interp;           /* Interpolation mode used when resampling */
   int nextfill;         /* Next frame idx where the buffer needs to be filled */
+  int level;            /* Mipmap level the buffer holds, 0 for the sound itself (LS) */
   int loop;             /* Whether the source will loop when `end` is reached */
   int rewind;           /* Whether the source will rewind before playing */
-  int active;           /* Whether the source is part of `sources` list */
+  int voice;            /* Index in the voice table, -1 if not active */
+  int dirty;            /* Whether the voice needs to pick up new parameters */
   double gain;          /* Gain set by `cm_set_gain()` */
+  double send_level;    /* Send level set by `cm_set_send()` (LS) */
+  int send;             /* Gain into the send bus (fixed point) (LS) */
+  int bus;              /* Submix bus set by `cm_set_bus()` (LS) */
   double pan;           /* Pan set by `cm_set_pan()` */
+  double azimuth, elevation, spread; /* Direction set by `cm_set_direction()` in degrees (LS) */
+  int directional;      /* Whether the source is panned by direction instead of `pan` (LS) */
+  double lweight[CM_MAX_OUTPUTS];   /* Pan law of `lgain` at unity gain (LS) */
+  double rweight[CM_MAX_OUTPUTS];   /* Pan law of `rgain` at unity gain (LS) */
+  double pitch;         /* Pitch set by `cm_set_pitch()` (LS) */
+  // (LS) emitter state, see `cm_set_emitter()`:
+  int emitter;          /* Whether the source is positioned relative to the listener */
+  double emitter_pos[3];
+  double emitter_vel[3];
+  int rolloff_curve;    /* One of CM_ROLLOFF_* */
+  double min_distance, max_distance, rolloff;
+  double attenuation;   /* Distance gain, applied on top of `gain` */
+  double doppler;       /* Doppler shift, applied on top of `pitch` */
+  double air_cutoff;    /* Cutoff of the air absorption lowpass `air`, 0 if not filtered */
+  cm_Biquad air;        /* Air absorption lowpass, run after `iir` */
+  cm_UInt64 start_time;  /* Mixer frame to start playing at, 0 once started (LS) */
+  int seek;             /* Frame to continue at when next mixed, -1 if none (LS) */
+  int loop_start, loop_end; /* Loop region, `loop_end` is 0 if none (LS) */
+  // (LS) queue, see `cm_set_next()`:
+  cm_Source *next;      /* Source started where this one ends */
+  int crossfade;        /* Frames `next` overlaps with the end of this source */
+  int xfade;            /* 1 while fading in, -1 while fading out, 0 otherwise */
+  cm_UInt64 xfade_start;/* Mixer frame the crossfade starts at */
+  int xfade_len;
+  void *data;           /* Sound data the source plays, for the owner of the source (LS) */
+  const cm_Mipmap *mipmap; /* Copies read from at high rates, NULL if none (LS) */
   int channel;			/* the channel associated with this source */
   void (*finished_cb)(int); /* Callback for when the source has finished (only called for non-looping sources) */
   // (LS):
@@ -87,9 +206,9 @@ struct cm_Source {
   double gainf;
   double fade_t0;
   double fade_T;
-  cm_Int16 xl[2],xr[2],x0l,x0r;
-  cm_Int16 yl[2],yr[2],y0l,y0r;
-  double a1,a2,b0,b1,b2;
+  cm_Biquad iir;
+  double prof_time;     /* Total time spent on the source while profiling */
+  int prof_blocks;      /* Number of blocks `prof_time` was measured over */
 };
 
 const char* cm_get_error(void);
@@ -97,23 +216,68 @@ void cm_init(int samplerate);
 void cm_set_lock(cm_EventHandler lock);
 void cm_set_time_function(double (time_function)(void));
 void cm_set_master_gain(double gain);
-void cm_process(cm_Int16 *dst, int len);
+void cm_set_format(int format, int channels); // (LS)
+void cm_set_speakers(const double *azimuth); // (LS)
+void cm_process(void *dst, int frames);
 
 cm_Source* cm_new_source(const cm_SourceInfo *info);
 cm_Source* cm_new_source_from_file(const char *filename);
 cm_Source* cm_new_source_from_mem(void *data, int size);
+cm_Source* cm_new_stream_from_file(const char *filename); // (LS)
+cm_SeekPoint* cm_build_seek_index(void *data, int size, int *count); // (LS)
+cm_SeekPoint* cm_build_seek_index_from_file(const char *filename, int *count); // (LS)
+void cm_set_seek_index(cm_Source *src, const cm_SeekPoint *index, int count); // (LS)
+cm_Mipmap* cm_build_mipmap(void *data, int size, int levels); // (LS)
+void cm_set_mipmap(cm_Source *src, const cm_Mipmap *mipmap); // (LS)
+void* cm_resample_to_wav(void *data, int size, int *outsize); // (LS)
+void* cm_convert_wav(void *data, int size, int *outsize, int *clipped); // (LS)
 void cm_destroy_source(cm_Source *src);
 double cm_get_length(cm_Source *src);
 double cm_get_position(cm_Source *src);
 int cm_get_state(cm_Source *src);
 void cm_set_gain(cm_Source *src, double gain);
 void cm_set_pan(cm_Source *src, double pan);
+void cm_set_send(cm_Source *src, double level); // (LS)
+void cm_set_direction(cm_Source *src, double azimuth, double elevation, double spread); // (LS)
+void cm_set_emitter(cm_Source *src, const double *position, const double *velocity); // (LS)
+void cm_set_attenuation(cm_Source *src, int curve, double min_distance, double max_distance, double rolloff); // (LS)
+void cm_set_listener(const double *position, const double *velocity, const double *forward, const double *up); // (LS)
+void cm_set_doppler(double speed_of_sound, double factor); // (LS)
+void cm_set_air_absorption(double distance); // (LS)
 void cm_set_pitch(cm_Source *src, double pitch);
+void cm_set_ring_size(cm_Source *src, int frames); // (LS)
+void cm_set_interpolation(cm_Source *src, int interp); // (LS)
 void cm_set_iir(cm_Source *src, double b0, double b1, double b2, double a1, double a2); // (LS)
 void cm_set_master_iir(double b0, double b1, double b2, double a1, double a2); // (LS)
+
+// (LS) submix buses, bus 0 being the master:
+typedef void (*cm_BusEffect)(float *buffer, int frames, int channels, void *udata);
+int cm_new_bus(const char *name, int parent);
+int cm_find_bus(const char *name);
+void cm_set_bus_gain(int bus, double gain);
+void cm_set_bus_iir(int bus, int stage, double b0, double b1, double b2, double a1, double a2);
+void cm_clear_bus_iir(int bus);
+void cm_set_bus_effect(int bus, cm_BusEffect effect, void *udata);
+void cm_set_bus_ducking(int bus, int key, double threshold, double ratio, double attack, double release);
+void cm_set_bus(cm_Source *src, int bus);
+void cm_process_iir(cm_Biquad *f, double x0l, double x0r, double *y0l, double *y0r); // (LS)
+int cm_set_convolution(void *data, int size, int threaded); // (LS)
+int cm_set_fdn(int mode, double rt60, double damping, double size, double wet); // (LS)
+int cm_set_limiter(double ceiling, double lookahead, double release); // (LS)
+double cm_get_limiter_gain(void); // (LS)
+void cm_set_threads(int n); // (LS)
+void cm_set_profiling(int enable); // (LS)
+void cm_reset_stats(void); // (LS)
+void cm_get_stats(cm_Stats *stats); // (LS)
+double cm_get_cost(cm_Source *src); // (LS)
 void cm_set_loop(cm_Source *src, int loop);
+void cm_set_loop_region(cm_Source *src, int start, int end); // (LS)
 void cm_play(cm_Source *src);
+void cm_play_at(cm_Source *src, cm_UInt64 time); // (LS)
+cm_UInt64 cm_get_clock(void); // (LS)
+void cm_set_next(cm_Source *src, cm_Source *next, double crossfade); // (LS)
 void cm_pause(cm_Source *src);
 void cm_stop(cm_Source *src);
+void cm_seek(cm_Source *src, double position); // (LS)
 
 #endif
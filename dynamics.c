@@ -0,0 +1,191 @@
+/*
+ *    Part of ls_mixer
+ *    Copyright (c) 2021-2022 Laurin Schnorr (laurin point schnorr at online point de)
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "dynamics.h"
+
+#define MIN(a, b)         ((a) < (b) ? (a) : (b))
+#define MAX(a, b)         ((a) > (b) ? (a) : (b))
+
+
+/*============================================================================
+** Limiter
+**============================================================================*/
+
+/* Each frame gets the gain that brings its peak down to the ceiling. The
+** minimum of these over a window of `length` frames drops as soon as a peak
+** enters the look-ahead delay and lasts until it has left it; it then
+** recovers exponentially. A moving average over `length` frames smooths the
+** attack into a ramp. Every value it averages when a frame comes out of the
+** delay has seen that frame's peak, so the output never exceeds the ceiling.
+**
+** The window minimum is kept in a monotonic queue: a new gain drops all
+** larger gains from the back, so the front is the minimum and each gain is
+** pushed and popped once. */
+
+struct cm_Limiter {
+  int length;           /* Look-ahead in frames */
+  int pos;              /* Position in the rings */
+  double ceiling;
+  double release;       /* Recovery coefficient per frame */
+  double env;           /* Gain after the window minimum and the recovery */
+  double sum;           /* Sum of `ramp` */
+  double *delay;        /* Delayed input, `length` frames of CM_MAX_OUTPUTS channels */
+  double *ramp;         /* Last `length` values of `env` */
+  double *qgain;        /* Queue of increasing gains, `length` entries */
+  int *qtime;           /* Frame each gain in the queue is from */
+  int qhead, qcount;
+  int time;             /* Frame counter, wraps at `length` * 2 */
+};
+
+
+cm_Limiter* cm_limiter_new(int samplerate, double ceiling, double lookahead, double release) {
+  int i;
+  cm_Limiter *l = calloc(1, sizeof(*l));
+  if (!l) {
+    return NULL;
+  }
+  l->length = MAX((int) (lookahead * samplerate), 1);
+  l->ceiling = ceiling;
+  l->release = 1.0 - exp(-1.0 / (MAX(release, 0.001) * samplerate));
+  l->env = 1.0;
+  l->sum = l->length;
+  l->delay = calloc(l->length * CM_MAX_OUTPUTS, sizeof(*l->delay));
+  l->ramp = malloc(l->length * sizeof(*l->ramp));
+  l->qgain = malloc(l->length * sizeof(*l->qgain));
+  l->qtime = malloc(l->length * sizeof(*l->qtime));
+  if (!l->delay || !l->ramp || !l->qgain || !l->qtime) {
+    cm_limiter_destroy(l);
+    return NULL;
+  }
+  for (i = 0; i < l->length; i++) {
+    l->ramp[i] = 1.0;
+  }
+  return l;
+}
+
+
+void cm_limiter_destroy(cm_Limiter *l) {
+  free(l->delay);
+  free(l->ramp);
+  free(l->qgain);
+  free(l->qtime);
+  free(l);
+}
+
+
+double cm_limiter_get_gain(cm_Limiter *l) {
+  return l->sum / l->length;
+}
+
+
+void cm_limiter_process(cm_Limiter *l, double *buf, int frames, int channels) {
+  int i, c, back;
+  double peak, gain, out, *d;
+
+  for (i = 0; i < frames; i++, buf += channels) {
+    /* Output the frame leaving the delay and put the new one in */
+    out = l->sum / l->length;
+    d = l->delay + l->pos * CM_MAX_OUTPUTS;
+    peak = 0.0;
+    for (c = 0; c < channels; c++) {
+      double x = buf[c];
+      buf[c] = d[c] * out;
+      d[c] = x;
+      peak = MAX(peak, fabs(x));
+    }
+    gain = peak > l->ceiling ? l->ceiling / peak : 1.0;
+
+    /* Window minimum */
+    while (l->qcount > 0) {
+      back = (l->qhead + l->qcount - 1) % l->length;
+      if (l->qgain[back] < gain) {
+        break;
+      }
+      l->qcount--;
+    }
+    if (l->qcount > 0 && l->qtime[l->qhead] == (l->time + l->length) % (l->length * 2)) {
+      l->qhead = (l->qhead + 1) % l->length;
+      l->qcount--;
+    }
+    back = (l->qhead + l->qcount) % l->length;
+    l->qgain[back] = gain;
+    l->qtime[back] = l->time;
+    l->qcount++;
+    l->time = (l->time + 1) % (l->length * 2);
+
+    /* Recovery, then the moving average */
+    l->env = MIN(l->qgain[l->qhead], l->env + (1.0 - l->env) * l->release);
+    l->sum += l->env - l->ramp[l->pos];
+    l->ramp[l->pos] = l->env;
+    if (++l->pos == l->length) {
+      /* Keep rounding errors from accumulating in the sum */
+      l->pos = 0;
+      l->sum = 0.0;
+      for (c = 0; c < l->length; c++) {
+        l->sum += l->ramp[c];
+      }
+    }
+  }
+}
+
+
+/*============================================================================
+** Compressor
+**============================================================================*/
+
+/* The gain is recomputed every GAIN_STEP frames and ramped linearly in
+** between, which keeps the pow() off the per frame path */
+#define GAIN_STEP         (16)
+
+void cm_compressor_init(cm_Compressor *c, int samplerate, double threshold, double ratio, double attack, double release) {
+  c->threshold = MAX(threshold, 1.0);
+  c->slope = 1.0 - 1.0 / MAX(ratio, 1.0);
+  c->attack = 1.0 - exp(-1.0 / (MAX(attack, 0.0001) * samplerate));
+  c->release = 1.0 - exp(-1.0 / (MAX(release, 0.001) * samplerate));
+  c->env = 0.0;
+  c->gain = 1.0;
+}
+
+
+void cm_compressor_process(cm_Compressor *c, const cm_Int32 *key, float *buf, int frames, int channels) {
+  int i, j, ch, n;
+  double peak, target, step;
+
+  for (i = 0; i < frames; i += GAIN_STEP) {
+    n = MIN(GAIN_STEP, frames - i);
+    for (j = 0; j < n; j++, key += channels) {
+      peak = 0.0;
+      for (ch = 0; ch < channels; ch++) {
+        peak = MAX(peak, fabs((double) key[ch]));
+      }
+      c->env += (peak - c->env) * (peak > c->env ? c->attack : c->release);
+    }
+    target = c->env > c->threshold ? pow(c->env / c->threshold, -c->slope) : 1.0;
+    step = (target - c->gain) / n;
+    for (j = 0; j < n; j++, buf += channels) {
+      c->gain += step;
+      for (ch = 0; ch < channels; ch++) {
+        buf[ch] *= c->gain;
+      }
+    }
+    c->gain = target;
+  }
+}
@@ -0,0 +1,53 @@
+/*
+ *    Part of ls_mixer
+ *    Copyright (c) 2021-2022 Laurin Schnorr (laurin point schnorr at online point de)
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Dynamics processors for the mixer's buses and master. Levels are in the
+** mixer's internal scale, where 32768.0 is full scale. */
+
+#ifndef DYNAMICS_H
+#define DYNAMICS_H
+
+#include "cmixer.h"
+
+typedef struct cm_Limiter cm_Limiter;
+
+/* Compressor keyed by another signal, small enough to live inside a bus */
+typedef struct {
+  double threshold;     /* Key level above which the gain is reduced */
+  double slope;         /* 1 - 1 / ratio */
+  double attack;        /* Envelope coefficients per frame */
+  double release;
+  double env;           /* Envelope of the key */
+  double gain;          /* Gain at the end of the last block */
+} cm_Compressor;
+
+/* Brickwall limiter that delays its input by `lookahead` seconds, so the gain
+** is already down when a peak above `ceiling` comes out, and recovers with a
+** time constant of `release` seconds. Returns NULL if out of memory. */
+cm_Limiter* cm_limiter_new(int samplerate, double ceiling, double lookahead, double release);
+void cm_limiter_process(cm_Limiter *l, double *buf, int frames, int channels);
+double cm_limiter_get_gain(cm_Limiter *l);
+void cm_limiter_destroy(cm_Limiter *l);
+
+/* `threshold` is in the same scale as the key, `attack` and `release` in
+** seconds. Processing reduces the gain of `buf` by how far the key's peak
+** envelope is above the threshold, `ratio` to 1. */
+void cm_compressor_init(cm_Compressor *c, int samplerate, double threshold, double ratio, double attack, double release);
+void cm_compressor_process(cm_Compressor *c, const cm_Int32 *key, float *buf, int frames, int channels);
+
+#endif
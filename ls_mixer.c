@@ -25,7 +25,25 @@ static SDL_AudioDeviceID dev;
 
 static SDL_mutex* audio_mutex;
 
-static uint16_t fs; // sample frequency [Hz]
+static int fs; // sample frequency [Hz]
+
+static int frame_bytes; // size of one frame of the device's output format
+
+static void destroy_queue(cm_Source *src);
+
+static int interpolation = CM_INTERP_LINEAR; // interpolation mode for new channels
+
+static struct // deadline monitoring of the audio callback, written by the audio thread only
+{
+	double last_entry; // time at which the previous callback started [s]
+	SDL_atomic_t callbacks; // number of callbacks
+	SDL_atomic_t late; // callbacks that took longer than their period
+	SDL_atomic_t gaps; // callbacks that started more than 1.5 periods after the previous one
+	SDL_atomic_t worst_overrun; // [us]
+	SDL_atomic_t worst_time; // [us]
+	SDL_atomic_t reset; // set by ls_mixer_get_deadline_stats() to clear the counters
+	void (*cb)(double); // called on the audio thread for every late callback
+} deadline;
 
 static void lock_handler(cm_Event *e) {
   if (e->type == CM_EVENT_LOCK) {
@@ -37,8 +55,45 @@ static void lock_handler(cm_Event *e) {
 }
 
 
+double ls_mixer_time(void)
+{
+		return (double)SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+}
+
 static void audio_callback(void *udata, Uint8 *stream, int size) {
-  cm_process((void*) stream, size / 2);
+  double t0, t1, period;
+  int us;
+  
+  t0 = ls_mixer_time();
+  cm_process((void*) stream, size / frame_bytes);
+  t1 = ls_mixer_time();
+  
+  /* Compare the time spent against the real-time budget of the block */
+  period = size / frame_bytes / (double) fs;
+  if (SDL_AtomicSet(&deadline.reset, 0))
+  {
+	  SDL_AtomicSet(&deadline.callbacks, 0);
+	  SDL_AtomicSet(&deadline.late, 0);
+	  SDL_AtomicSet(&deadline.gaps, 0);
+	  SDL_AtomicSet(&deadline.worst_overrun, 0);
+	  SDL_AtomicSet(&deadline.worst_time, 0);
+  }
+  else if (SDL_AtomicGet(&deadline.callbacks) > 0 && t0 - deadline.last_entry > 1.5 * period)
+  {
+	  SDL_AtomicAdd(&deadline.gaps, 1);
+  }
+  SDL_AtomicAdd(&deadline.callbacks, 1);
+  deadline.last_entry = t0;
+  
+  us = (t1 - t0) * 1e6;
+  if (us > SDL_AtomicGet(&deadline.worst_time)) SDL_AtomicSet(&deadline.worst_time, us);
+  if (t1 - t0 > period)
+  {
+	  SDL_AtomicAdd(&deadline.late, 1);
+	  us = (t1 - t0 - period) * 1e6;
+	  if (us > SDL_AtomicGet(&deadline.worst_overrun)) SDL_AtomicSet(&deadline.worst_overrun, us);
+	  if (deadline.cb) deadline.cb(t1 - t0 - period);
+  }
 }
 
 
@@ -75,9 +130,15 @@ static void* load_file(const char *filename, int *size) {
   return data;
 }
 
-double ls_mixer_time(void)
+static int output_format(SDL_AudioFormat format) // cmixer output format for an SDL audio format, -1 if not supported
 {
-		return (double)SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+	switch (format)
+	{
+		case AUDIO_S16SYS: return CM_FORMAT_S16;
+		case AUDIO_S32SYS: return CM_FORMAT_S32;
+		case AUDIO_F32SYS: return CM_FORMAT_F32;
+	}
+	return -1;
 }
 
 void ls_mixer_init(uint16_t freq,uint16_t samples)
@@ -94,22 +155,32 @@ void ls_mixer_init(uint16_t freq,uint16_t samples)
   /* Init SDL audio */
   memset(&fmt, 0, sizeof(fmt));
   fmt.freq      = freq;
-  fmt.format    = AUDIO_S16;
+  fmt.format    = AUDIO_F32SYS;
   fmt.channels  = 2;
   fmt.samples   = samples;
   fmt.callback  = audio_callback;
 
-  dev = SDL_OpenAudioDevice(NULL, 0, &fmt, &got, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  /* Take the device's own format and channel layout if the mixer can write it
+  ** directly, so SDL does not need to convert the audio */
+  dev = SDL_OpenAudioDevice(NULL, 0, &fmt, &got, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+  if (dev != 0 && (output_format(got.format) < 0 || (got.channels != 1 && got.channels % 2) || got.channels > 8)) {
+    SDL_CloseAudioDevice(dev);
+    dev = SDL_OpenAudioDevice(NULL, 0, &fmt, &got, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  }
   if (dev == 0) {
     fprintf(stderr, "Error: failed to open audio device '%s'\n", SDL_GetError());
     exit(EXIT_FAILURE);
   }
 
   /* Init library */
+  fs = got.freq; // the device may not support the requested frequency
+  frame_bytes = got.channels * SDL_AUDIO_BITSIZE(got.format) / 8;
   cm_init(got.freq);
+  cm_set_format(output_format(got.format), got.channels);
   cm_set_lock(lock_handler);
   cm_set_time_function(ls_mixer_time);
-  cm_set_master_gain(0.5);
+  cm_set_master_gain(1.0);
+  cm_set_limiter(-1.0, 0.005, 0.1); // the limiter keeps peaks from clipping, so no headroom is needed
 
   /* Start audio */
   SDL_PauseAudioDevice(dev, 0);
@@ -125,10 +196,15 @@ void ls_mixer_init(uint16_t freq,uint16_t samples)
 void ls_mixer_close()
 {
 	int i;
+	cm_set_threads(0);
+	cm_set_convolution(NULL, 0, 0);
+	cm_set_fdn(CM_FDN_OFF, 0.0, 0.0, 0.0, 0.0);
+	cm_set_limiter(0.0, 0.0, 0.0);
 	for (i=0; i < LS_MIXER_NCHANNEL; i++)
   {
 	  if (channel[i].src != NULL)
 	  {
+		  destroy_queue(channel[i].src);
 		  cm_destroy_source(channel[i].src);
 		  channel[i].src = NULL;
 	  }
@@ -137,15 +213,84 @@ void ls_mixer_close()
 	return;
 }
 
+void ls_mixer_set_threads(int n)
+{
+	if (n < 0) n = SDL_GetCPUCount() - 1;
+	cm_set_threads(n);
+	return;
+}
+
+void ls_mixer_get_deadline_stats(ls_mixer_deadline_stats *stats, int reset)
+{
+	stats->callbacks = SDL_AtomicGet(&deadline.callbacks);
+	stats->late = SDL_AtomicGet(&deadline.late);
+	stats->gaps = SDL_AtomicGet(&deadline.gaps);
+	stats->worst_overrun = SDL_AtomicGet(&deadline.worst_overrun) * 1e-6;
+	stats->worst_time = SDL_AtomicGet(&deadline.worst_time) * 1e-6;
+	if (reset) SDL_AtomicSet(&deadline.reset, 1);
+	return;
+}
+
+void ls_mixer_set_deadline_cb(void (*cb)(double))
+{
+	deadline.cb = cb;
+	return;
+}
+
+void ls_mixer_set_profiling(int enable)
+{
+	cm_set_profiling(enable);
+	return;
+}
+
+void ls_mixer_get_stats(ls_mixer_stats *stats, int reset)
+{
+	int i;
+	cm_get_stats(&stats->mixer);
+	for (i=0; i < LS_MIXER_NCHANNEL; i++)
+	{
+		stats->channel[i] = channel[i].src ? cm_get_cost(channel[i].src) : 0.0;
+	}
+	if (reset) cm_reset_stats();
+	return;
+}
+
+static void destroy_queue(cm_Source *src) // destroys the sources queued after src
+{
+	cm_Source *next = src->next;
+	cm_set_next(src, NULL, 0.0);
+	while (next)
+	{
+		src = next;
+		next = src->next;
+		cm_destroy_source(src);
+	}
+	return;
+}
+
+static cm_Source *channel_src(int chan) // current source of a channel, moving on to the next queued one once it has finished
+{
+	cm_Source *src = channel[chan].src;
+	while (src && src->next && cm_get_state(src) == CM_STATE_STOPPED)
+	{
+		channel[chan].src = src->next;
+		channel[chan].data = src->next->data;
+		if (src->next->voice < 0) cm_play(src->next); // the mixer had no free voice to start it
+		cm_destroy_source(src);
+		src = channel[chan].src;
+	}
+	return src;
+}
 
 int ls_mixer_find_free_channel()
 {
 	int i;
 	for (i=0; i < LS_MIXER_NCHANNEL; i++)
 	{
-		if (channel[i].src == NULL) return i;
+		if (channel_src(i) == NULL) return i;
 		if (cm_get_state(channel[i].src) == CM_STATE_STOPPED)
 		{
+			destroy_queue(channel[i].src);
 			cm_destroy_source(channel[i].src);
 			channel[i].src = NULL;
 			return i;
@@ -162,23 +307,196 @@ ls_mixer_sounddata *ls_mixer_load(const char *filename)
 	load = malloc(sizeof(struct ls_mixer_sounddata));
 	load->filename = strdup(filename);
 	load->data = load_file(filename, &load->size);
+	if (load->data)
+	{
+		// WAV formats the mixer can't play directly are converted once here, not on every play
+		int size, clipped;
+		void *data = cm_convert_wav(load->data, load->size, &size, &clipped);
+		if (data)
+		{
+			if (clipped) fprintf(stderr,"ls_mixer_load: %d samples of sound \"%s\" go beyond full scale and were clipped\n",clipped,filename);
+			free(load->data);
+			load->data = data;
+			load->size = size;
+		}
+	}
+	load->stream = 0;
+	load->seek_index = NULL;
+	load->seek_points = 0;
+	load->mipmap = NULL;
+	load->loop_start = load->loop_end = -1.0;
 	return load;
 }
 
-void ls_mixer_delete(ls_mixer_sounddata *sound)
+ls_mixer_sounddata *ls_mixer_load_stream(const char *filename)
+{
+	struct ls_mixer_sounddata *load;
+	FILE *fp = fopen(filename, "rb");
+	if (!fp)
+	{
+		fprintf(stderr,"ls_mixer_load_stream: Could not open \"%s\"!\n",filename);
+		return NULL;
+	}
+	fclose(fp);
+	load = malloc(sizeof(struct ls_mixer_sounddata));
+	load->filename = strdup(filename);
+	load->data = NULL; // every channel playing the sound opens the file itself
+	load->size = 0;
+	load->stream = 1;
+	load->seek_index = NULL;
+	load->seek_points = 0;
+	load->mipmap = NULL;
+	load->loop_start = load->loop_end = -1.0;
+	return load;
+}
+
+void ls_mixer_set_loop_region(ls_mixer_sounddata *sound, double start, double end)
+{
+	sound->loop_start = start;
+	sound->loop_end = end;
+	return;
+}
+
+int ls_mixer_build_seek_index(ls_mixer_sounddata *sound)
+{
+	int i;
+	cm_SeekPoint *index;
+	cm_Source *src;
+	int count;
+	if (sound->stream) index = cm_build_seek_index_from_file(sound->filename, &count);
+	else index = cm_build_seek_index(sound->data, sound->size, &count);
+	if (!index)
+	{
+		fprintf(stderr,"ls_mixer_build_seek_index: Could not index sound \"%s\": %s\n",sound->filename,cm_get_error());
+		return -1;
+	}
+	for (i=0; i < LS_MIXER_NCHANNEL; i++) // the decoders of channels and queues playing the sound still use the old index
+	{
+		for (src = channel[i].src; src; src = src->next)
+		{
+			if (src->data == sound) cm_set_seek_index(src, index, count);
+		}
+	}
+	free(sound->seek_index);
+	sound->seek_index = index;
+	sound->seek_points = count;
+	return 0;
+}
+
+int ls_mixer_build_mipmap(ls_mixer_sounddata *sound)
+{
+	int i;
+	cm_Mipmap *mipmap;
+	cm_Source *src;
+	if (sound->stream)
+	{
+		fprintf(stderr,"ls_mixer_build_mipmap: Sound \"%s\" is streamed and has no mipmap!\n",sound->filename);
+		return -1;
+	}
+	mipmap = cm_build_mipmap(sound->data, sound->size, CM_MIP_LEVELS);
+	if (!mipmap)
+	{
+		fprintf(stderr,"ls_mixer_build_mipmap: Could not build mipmap of sound \"%s\": %s\n",sound->filename,cm_get_error());
+		return -1;
+	}
+	for (i=0; i < LS_MIXER_NCHANNEL; i++) // channels and queues playing the sound switch over to the new mipmap
+	{
+		for (src = channel[i].src; src; src = src->next)
+		{
+			if (src->data == sound) cm_set_mipmap(src, mipmap);
+		}
+	}
+	free(sound->mipmap);
+	sound->mipmap = mipmap;
+	return 0;
+}
+
+static cm_Source *new_source(ls_mixer_sounddata *sound)
+{
+	cm_Source *src;
+	if (sound->stream) src = cm_new_stream_from_file(sound->filename);
+	else src = cm_new_source_from_mem(sound->data, sound->size);
+	if (src)
+	{
+		src->data = sound;
+		if (sound->seek_index) cm_set_seek_index(src, sound->seek_index, sound->seek_points);
+		if (sound->mipmap) cm_set_mipmap(src, sound->mipmap);
+	}
+	else fprintf(stderr,"ls_mixer: Could not open sound \"%s\": %s\n",sound->filename,cm_get_error());
+	return src;
+}
+
+static void set_loop_region(cm_Source *src, ls_mixer_sounddata *sound) // loop region in frames of the source
+{
+	if (sound->loop_end < 0.0) cm_set_loop_region(src, -1, -1);
+	else if (sound->loop_end == 0.0) cm_set_loop_region(src, 0, 0);
+	else cm_set_loop_region(src, (int) (sound->loop_start * src->samplerate + 0.5), (int) (sound->loop_end * src->samplerate + 0.5));
+	return;
+}
+
+static void stop_sound_channels(ls_mixer_sounddata *sound)
 {
 	int i;
-	for (i=0; i < LS_MIXER_NCHANNEL; i++) // destroy all sources that use the deleted data
+	cm_Source *src;
+	for (i=0; i < LS_MIXER_NCHANNEL; i++) // destroy all sources that use the sound data
 	{
-		if (channel[i].data == sound->data) 
+		if (channel_src(i) == NULL) continue;
+		for (src = channel[i].src; src->next; src = src->next) // drop it and everything after it from the queue
+		{
+			if (src->next->data == sound)
+			{
+				destroy_queue(src);
+				break;
+			}
+		}
+		if (channel[i].data == sound) 
 		{
+			destroy_queue(channel[i].src);
 			cm_destroy_source(channel[i].src);
 			channel[i].src = NULL;
 			channel[i].data = NULL; // freed later via other reference
 		}
 	}
+	return;
+}
+
+int ls_mixer_resample(ls_mixer_sounddata *sound)
+{
+	int size;
+	if (sound->stream)
+	{
+		fprintf(stderr,"ls_mixer_resample: Sound \"%s\" is streamed and can't be converted!\n",sound->filename);
+		return -1;
+	}
+	void *data = cm_resample_to_wav(sound->data, sound->size, &size);
+	if (!data)
+	{
+		fprintf(stderr,"ls_mixer_resample: Could not convert sound \"%s\": %s\n",sound->filename,cm_get_error());
+		return -1;
+	}
+	stop_sound_channels(sound);
+	free(sound->data);
+	sound->data = data;
+	sound->size = size;
+	free(sound->seek_index); // WAV data needs none
+	sound->seek_index = NULL;
+	sound->seek_points = 0;
+	if (sound->mipmap) // made for the old rate
+	{
+		free(sound->mipmap);
+		sound->mipmap = NULL;
+		ls_mixer_build_mipmap(sound);
+	}
+	return 0;
+}
+
+void ls_mixer_delete(ls_mixer_sounddata *sound)
+{
+	stop_sound_channels(sound);
 	sound->size = 0;
 	free(sound->data);
+	free(sound->seek_index);
+	free(sound->mipmap);
 	free(sound->filename);
 	free(sound);
 	return;
@@ -186,20 +504,26 @@ void ls_mixer_delete(ls_mixer_sounddata *sound)
 
 double ls_mixer_get_position(int chan)
 {
-    return cm_get_position(channel[chan].src);
+    return cm_get_position(channel_src(chan));
+}
+
+void ls_mixer_seek(int chan, double position)
+{
+	cm_seek(channel_src(chan), position);
+	return;
 }
 
 void ls_mixer_set_gain(int chan,double gain)
 {
 	if (chan == -1) cm_set_master_gain(gain);
-	else cm_set_gain(channel[chan].src, gain);
+	else cm_set_gain(channel_src(chan), gain);
 	return;
 }
 
 void ls_mixer_set_iir(int chan, double b0, double b1, double b2, double a1, double a2)
 {
 	if (chan == -1) cm_set_master_iir(b0, b1, b2, a1, a2);
-	else cm_set_iir(channel[chan].src, b0, b1, b2, a1, a2);
+	else cm_set_iir(channel_src(chan), b0, b1, b2, a1, a2);
 	return;
 }
 
@@ -233,7 +557,7 @@ void ls_mixer_set_bandpass(int chan, double f1, double f2) // calculate IIR coef
 }
 */
 
-void ls_mixer_set_lowpass(int chan, int n, double fc) // calculate IIR coefficients for a Butterworth lowpass of order n <= 2
+static void lowpass_coefs(int n, double fc, double *c) // Butterworth lowpass coefficients b0, b1, b2, a1, a2
 {
 	double *dcof;     // d coefficients =^ a
 	int *ccof;        // c coefficients =^ b
@@ -250,13 +574,22 @@ void ls_mixer_set_lowpass(int chan, int n, double fc) // calculate IIR coefficie
 	/* calculate the c coefficients */
     ccof = ccof_bwlp( n );
 	sf = sf_bwlp( n, fcf ); /* scaling factor for the c coefficients */
-	ls_mixer_set_iir(chan,(double)ccof[0]*sf,(double)ccof[1]*sf,(double)ccof[2]*sf,dcof[1],dcof[2]);
+	c[0] = (double)ccof[0]*sf; c[1] = (double)ccof[1]*sf; c[2] = (double)ccof[2]*sf;
+	c[3] = dcof[1]; c[4] = dcof[2];
 	free( dcof );
     free( ccof );
 	return;
 }
 
-void ls_mixer_set_highpass(int chan, int n, double fc) // calculate IIR coefficients for a Butterworth highpass of order n <= 2
+void ls_mixer_set_lowpass(int chan, int n, double fc) // calculate IIR coefficients for a Butterworth lowpass of order n <= 2
+{
+	double c[5];
+	lowpass_coefs(n, fc, c);
+	ls_mixer_set_iir(chan,c[0],c[1],c[2],c[3],c[4]);
+	return;
+}
+
+static void highpass_coefs(int n, double fc, double *c) // Butterworth highpass coefficients b0, b1, b2, a1, a2
 {
 	double *dcof;     // d coefficients =^ a
 	int *ccof;        // c coefficients =^ b
@@ -273,12 +606,21 @@ void ls_mixer_set_highpass(int chan, int n, double fc) // calculate IIR coeffici
 	/* calculate the c coefficients */
     ccof = ccof_bwhp( n );
 	sf = sf_bwhp( n, fcf ); /* scaling factor for the c coefficients */
-	ls_mixer_set_iir(chan,(double)ccof[0]*sf,(double)ccof[1]*sf,(double)ccof[2]*sf,dcof[1],dcof[2]);
+	c[0] = (double)ccof[0]*sf; c[1] = (double)ccof[1]*sf; c[2] = (double)ccof[2]*sf;
+	c[3] = dcof[1]; c[4] = dcof[2];
 	free( dcof );
     free( ccof );
 	return;
 }
 
+void ls_mixer_set_highpass(int chan, int n, double fc) // calculate IIR coefficients for a Butterworth highpass of order n <= 2
+{
+	double c[5];
+	highpass_coefs(n, fc, c);
+	ls_mixer_set_iir(chan,c[0],c[1],c[2],c[3],c[4]);
+	return;
+}
+
 void ls_mixer_set_bandpass(int chan, double f1, double f2) // calculate IIR coefficients for a first order Butterworth bandpass
 {
 	double *dcof;     // d coefficients =^ a
@@ -329,42 +671,201 @@ void ls_mixer_set_bandstop(int chan, double f1, double f2) // calculate IIR coef
 
 
 
+int ls_mixer_new_bus(const char *name, int parent)
+{
+	int bus = cm_new_bus(name, parent);
+	if (bus < 0) fprintf(stderr,"ls_mixer_new_bus: Could not create bus \"%s\": %s\n",name,cm_get_error());
+	return bus;
+}
+
+int ls_mixer_get_bus(const char *name)
+{
+	return cm_find_bus(name);
+}
+
+void ls_mixer_set_bus(int chan, int bus)
+{
+	if (chan >= 0) cm_set_bus(channel_src(chan), bus);
+	return;
+}
+
+void ls_mixer_set_bus_gain(int bus, double gain)
+{
+	cm_set_bus_gain(bus, gain);
+	return;
+}
+
+void ls_mixer_set_bus_iir(int bus, int stage, double b0, double b1, double b2, double a1, double a2)
+{
+	cm_set_bus_iir(bus, stage, b0, b1, b2, a1, a2);
+	return;
+}
+
+void ls_mixer_set_bus_lowpass(int bus, int stage, int n, double fc)
+{
+	double c[5];
+	lowpass_coefs(n, fc, c);
+	cm_set_bus_iir(bus, stage, c[0], c[1], c[2], c[3], c[4]);
+	return;
+}
+
+void ls_mixer_set_bus_highpass(int bus, int stage, int n, double fc)
+{
+	double c[5];
+	highpass_coefs(n, fc, c);
+	cm_set_bus_iir(bus, stage, c[0], c[1], c[2], c[3], c[4]);
+	return;
+}
+
+void ls_mixer_clear_bus_filters(int bus)
+{
+	cm_clear_bus_iir(bus);
+	return;
+}
+
+void ls_mixer_set_bus_effect(int bus, void (*effect)(float*, int, int, void*), void *udata)
+{
+	cm_set_bus_effect(bus, effect, udata);
+	return;
+}
+
+void ls_mixer_set_bus_ducking(int bus, int key, double threshold, double ratio, double attack, double release)
+{
+	cm_set_bus_ducking(bus, key, threshold, ratio, attack, release);
+	return;
+}
+
+int ls_mixer_set_limiter(double ceiling, double lookahead, double release)
+{
+	return cm_set_limiter(ceiling, lookahead, release);
+}
+
+double ls_mixer_get_limiter_gain(void)
+{
+	return cm_get_limiter_gain();
+}
+
 void ls_mixer_set_pitch(int chan,double pitch)
 {
-	if (chan >= 0) cm_set_pitch(channel[chan].src, pitch);
+	if (chan >= 0) cm_set_pitch(channel_src(chan), pitch);
+	return;
+}
+
+void ls_mixer_set_interpolation(int chan, int interp)
+{
+	if (chan == -1) interpolation = interp;
+	else if (chan >= 0 && chan < LS_MIXER_NCHANNEL) cm_set_interpolation(channel_src(chan), interp);
 	return;
 }
 
 void ls_mixer_set_pan(int chan,double pan)
 {
-	if (chan >= 0) cm_set_pan(channel[chan].src, pan);
+	if (chan >= 0) cm_set_pan(channel_src(chan), pan);
+	return;
+}
+
+void ls_mixer_set_direction(int chan, double azimuth, double elevation, double spread)
+{
+	if (chan >= 0) cm_set_direction(channel_src(chan), azimuth, elevation, spread);
+	return;
+}
+
+void ls_mixer_set_speakers(const double *azimuth)
+{
+	cm_set_speakers(azimuth);
+	return;
+}
+
+void ls_mixer_set_send(int chan, double level)
+{
+	if (chan >= 0) cm_set_send(channel_src(chan), level);
+	return;
+}
+
+int ls_mixer_set_reverb(ls_mixer_sounddata *ir, int threaded)
+{
+	if (ir && ir->stream)
+	{
+		fprintf(stderr,"ls_mixer_set_reverb: Impulse response \"%s\" must be loaded with ls_mixer_load()!\n",ir->filename);
+		return -1;
+	}
+	if (cm_set_convolution(ir ? ir->data : NULL, ir ? ir->size : 0, threaded) < 0)
+	{
+		fprintf(stderr,"ls_mixer_set_reverb: Could not load impulse response \"%s\": %s\n",ir->filename,cm_get_error());
+		return -1;
+	}
+	return 0;
+}
+
+int ls_mixer_set_fdn_reverb(int mode, double rt60, double damping, double size, double wet)
+{
+	return cm_set_fdn(mode, rt60, damping, size, wet);
+}
+
+void ls_mixer_set_emitter(int chan, const double *position, const double *velocity)
+{
+	if (chan >= 0) cm_set_emitter(channel_src(chan), position, velocity);
+	return;
+}
+
+void ls_mixer_set_attenuation(int chan, int curve, double min_distance, double max_distance, double rolloff)
+{
+	if (chan >= 0) cm_set_attenuation(channel_src(chan), curve, min_distance, max_distance, rolloff);
+	return;
+}
+
+void ls_mixer_set_listener(const double *position, const double *velocity, const double *forward, const double *up)
+{
+	cm_set_listener(position, velocity, forward, up);
+	return;
+}
+
+void ls_mixer_set_doppler(double speed_of_sound, double factor)
+{
+	cm_set_doppler(speed_of_sound, factor);
+	return;
+}
+
+void ls_mixer_set_air_absorption(double distance)
+{
+	cm_set_air_absorption(distance);
 	return;
 }
 
 void ls_mixer_stop(int chan) // TODO: all channels/master channel
 {
-	cm_stop(channel[chan].src);
+	cm_Source *src = channel_src(chan);
+	destroy_queue(src);
+	cm_stop(src);
 	return;
 }
 
 void ls_mixer_pause(int chan) // TODO: all channels/master channel
 {
-	cm_pause(channel[chan].src);
+	cm_pause(channel_src(chan));
 	return;
 }
 
 void ls_mixer_resume(int chan) // TODO: all channels/master channel
 {
-	cm_play(channel[chan].src);
+	cm_play(channel_src(chan));
 	return;
 }
 
 int ls_mixer_play(ls_mixer_sounddata *sound,int loop, double gain, double pan, double pitch)
+{
+	return ls_mixer_play_at(sound, 0, loop, gain, pan, pitch);
+}
+
+int ls_mixer_play_at(ls_mixer_sounddata *sound, uint64_t time, int loop, double gain, double pan, double pitch)
 {
 	cm_Source *src;
-	src = cm_new_source_from_mem(sound->data, sound->size);
+	src = new_source(sound);
+	if (!src) return -1;
 	cm_set_loop(src, loop);
+	if (loop) set_loop_region(src, sound);
 	cm_set_pitch(src, pitch);
+	cm_set_interpolation(src, interpolation);
 	cm_set_gain(src, gain);
 	cm_set_pan(src, pan);
 	int channel_i = ls_mixer_find_free_channel();
@@ -375,17 +876,53 @@ int ls_mixer_play(ls_mixer_sounddata *sound,int loop, double gain, double pan, d
 		return -1;
 	}
 	src->channel = channel_i;
-	cm_play(src);
+	cm_play_at(src, time);
 	channel[channel_i].src = src;
-	channel[channel_i].data = sound->data;
+	channel[channel_i].data = sound;
 	//printf("Playing sound \"%s\" on channel %d...\n",sound->filename,channel_i);
 	//printf("Länge: %g s\n",src->)
 	return channel_i;
 }
 
+int ls_mixer_queue(int chan, ls_mixer_sounddata *sound, double crossfade)
+{
+	cm_Source *last = channel_src(chan), *src;
+	if (!last)
+	{
+		fprintf(stderr,"ls_mixer_queue: No sound playing on channel %d!\n",chan);
+		return -1;
+	}
+	while (last->next) last = last->next;
+	src = new_source(sound);
+	if (!src) return -1;
+	// the queued sound plays like the one before it:
+	cm_set_pitch(src, last->pitch);
+	cm_set_interpolation(src, last->interp);
+	cm_set_gain(src, last->gain);
+	cm_set_pan(src, last->pan);
+	cm_set_send(src, last->send_level);
+	cm_set_bus(src, last->bus);
+	src->channel = chan;
+	src->finished_cb = last->finished_cb;
+	cm_set_next(last, src, crossfade);
+	return 0;
+}
+
+void ls_mixer_clear_queue(int chan)
+{
+	cm_Source *src = channel_src(chan);
+	if (src) destroy_queue(src);
+	return;
+}
+
+uint64_t ls_mixer_get_clock(void)
+{
+	return cm_get_clock();
+}
+
 void ls_mixer_set_finished_cb_channel(int chan, void (*cb)(int))
 {
-	if (channel[chan].src) channel[chan].src->finished_cb = cb;
+	if (channel_src(chan)) channel_src(chan)->finished_cb = cb;
 	else 
 	{
 		fprintf(stderr,"Should set callback for empty channel %d!\n",chan);
@@ -399,8 +936,8 @@ void ls_mixer_set_finished_cb_all(void (*cb)(int))
 	int i;
 	for (i=0; i < LS_MIXER_NCHANNEL; i++)
 	{
-		if (channel[i].src == NULL) continue;
-		channel[i].src->finished_cb = cb;
+		cm_Source *src;
+		for (src = channel_src(i); src; src = src->next) src->finished_cb = cb;
 	}
 	
 	return;
@@ -409,7 +946,7 @@ void ls_mixer_set_finished_cb_all(void (*cb)(int))
 
 void ls_mixer_fade(int chan,double T,double gainf)
 {
-	cm_Source *src = channel[chan].src;
+	cm_Source *src = channel_src(chan);
 	if (!src)
 	{
 		fprintf(stderr,"ls_mixer_fade: No sound playing on channel %d!\n",chan);
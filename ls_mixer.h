@@ -34,12 +34,37 @@
 
 #include "cmixer.h"
 
+/**
+ * \brief Interpolation modes for ls_mixer_set_interpolation()
+ * 
+ * Linear interpolation is the cheapest, the 4 tap cubic Hermite interpolation and the windowed sinc
+ * interpolation (CM_SINC_TAPS taps, see cmixer.h) alias less at increasing cost.
+ */
+#define LS_MIXER_INTERP_LINEAR CM_INTERP_LINEAR
+#define LS_MIXER_INTERP_CUBIC CM_INTERP_CUBIC
+#define LS_MIXER_INTERP_SINC CM_INTERP_SINC
+
+/**
+ * \brief Azimuth for ls_mixer_set_speakers() of an output channel that is not used for panning (e.g. the LFE)
+ */
+#define LS_MIXER_SPEAKER_NONE CM_SPEAKER_NONE
+
+/**
+ * \brief Distance attenuation curves for ls_mixer_set_attenuation()
+ * 
+ * With the distance d clamped to [min_distance, max_distance]:
+ * inverse min / (min + rolloff * (d - min)), linear 1 - rolloff * (d - min) / (max - min)
+ * and exponential (d / min) ^ -rolloff.
+ */
+#define LS_MIXER_ROLLOFF_INVERSE CM_ROLLOFF_INVERSE
+#define LS_MIXER_ROLLOFF_LINEAR CM_ROLLOFF_LINEAR
+#define LS_MIXER_ROLLOFF_EXPONENTIAL CM_ROLLOFF_EXPONENTIAL
 
 
 struct ls_mixer_channel
 {
 	cm_Source *src;
-	void *data;
+	void *data; // the ls_mixer_sounddata playing
 };
 
 struct ls_mixer_sounddata
@@ -47,6 +72,11 @@ struct ls_mixer_sounddata
 	void *data;
 	int size;
 	char *filename;
+	int stream; // 1 if loaded with ls_mixer_load_stream()
+	cm_SeekPoint *seek_index; // page index of an OGG file for ls_mixer_seek(), NULL if none (see ls_mixer_build_seek_index())
+	int seek_points; // number of entries in seek_index
+	cm_Mipmap *mipmap; // octave-down copies played at high pitch, NULL if none (see ls_mixer_build_mipmap())
+	double loop_start, loop_end; // loop region of looped playback in seconds, -1.0 for the one stored in the file (see ls_mixer_set_loop_region())
 };
 
 /**
@@ -54,6 +84,31 @@ struct ls_mixer_sounddata
  */
 typedef struct ls_mixer_sounddata ls_mixer_sounddata;
 
+struct ls_mixer_stats
+{
+	cm_Stats mixer; // time per block of the stages of the mixer (see cm_Stats in cmixer.h)
+	double channel[LS_MIXER_NCHANNEL]; // average time per block in microseconds spent on each channel, 0.0 for free channels
+};
+
+/**
+ * \brief Data structure for profiling statistics
+ */
+typedef struct ls_mixer_stats ls_mixer_stats;
+
+struct ls_mixer_deadline_stats
+{
+	int callbacks; // number of audio callbacks
+	int late; // callbacks that took longer than the duration of the audio they produced
+	int gaps; // callbacks that started more than 1.5 buffer durations after the previous one, i.e. the device probably ran dry
+	double worst_overrun; // longest time in seconds by which a callback exceeded its budget
+	double worst_time; // longest time in seconds a callback took
+};
+
+/**
+ * \brief Data structure for deadline statistics of the audio callback
+ */
+typedef struct ls_mixer_deadline_stats ls_mixer_deadline_stats;
+
 /**
  * \brief Initialize the library.
  *
@@ -72,6 +127,58 @@ void ls_mixer_init(uint16_t freq,uint16_t samples);
  */
 void ls_mixer_close();
 
+/**
+ * \brief Sets the number of mixing threads.
+ *
+ * By default all channels are mixed on the audio thread. With many channels playing at once,
+ * additional worker threads can share the work. The audio thread keeps mixing as well, so n=0 restores the default.
+ *
+ * \param n The number of additional worker threads (at most 16), or -1 for one less than the number of CPU cores.
+ */
+void ls_mixer_set_threads(int n);
+
+/**
+ * \brief Gets the deadline statistics of the audio callback.
+ *
+ * Every audio callback is timed and compared against its real-time budget, i.e. the duration of the
+ * audio it produces (samples / freq as passed to ls_mixer_init()). Late callbacks cause audible dropouts.
+ * This does not block the audio thread.
+ *
+ * \param stats The structure to be filled in
+ * \param reset Whether the statistics should be reset afterwards (1) or not (0)
+ */
+void ls_mixer_get_deadline_stats(ls_mixer_deadline_stats *stats, int reset);
+
+/**
+ * \brief Register callback function for late audio callbacks.
+ *
+ * The function is called on the audio thread each time an audio callback took longer than its budget,
+ * so it must return quickly.
+ * \param cb The callback function which is called with the overrun in seconds, or NULL to remove it
+ */
+void ls_mixer_set_deadline_cb(void (*cb)(double));
+
+/**
+ * \brief Enables or disables profiling of the audio thread.
+ *
+ * While enabled, the time spent on decoding, mixing, the master filter and the finished callbacks
+ * is measured for every audio block and every channel. Enabling it resets the statistics.
+ *
+ * \param enable 1 to enable, 0 to disable profiling
+ */
+void ls_mixer_set_profiling(int enable);
+
+/**
+ * \brief Gets the profiling statistics.
+ *
+ * Returns the statistics collected since profiling was enabled or the statistics were reset.
+ * This does not block the audio thread and can be called at any time, e.g. once per frame for an overlay.
+ *
+ * \param stats The structure to be filled in
+ * \param reset Whether the statistics should be reset afterwards (1) or not (0)
+ */
+void ls_mixer_get_stats(ls_mixer_stats *stats, int reset);
+
 /**
  * \brief Finds a free channel.
  *
@@ -85,6 +192,11 @@ int ls_mixer_find_free_channel();
  *
  * Loads an audio file into memory. The file format can be either .ogg or .wav. 
  * OGG files are decoded on the fly and are only stored in memory in encoded form.
+ * WAV files other than 8 or 16bit mono or stereo (24/32bit, float, more channels) are converted to
+ * 16bit once here, with more than two channels folded down to stereo. The mixer plays 16bit samples only,
+ * so the extra resolution of 24/32bit and float files is lost, and float samples beyond full scale (and
+ * fold-downs adding up beyond it) are clipped. The level is never changed; a warning with the number of
+ * clipped samples is printed instead, so such files should be turned down before they are loaded.
  * 
  * \param filename The path to the file that is to be loaded.
  * 
@@ -92,6 +204,87 @@ int ls_mixer_find_free_channel();
  */
 ls_mixer_sounddata *ls_mixer_load(const char *filename);
 
+/**
+ * \brief Prepares an OGG file for streaming from disk.
+ *
+ * Instead of keeping the file in memory, every channel playing the sound opens the file and decodes it a
+ * little ahead on a background I/O thread. Each playing stream takes a fixed ~300 KB of memory, however long
+ * the file is, which makes this the way to play long music tracks and ambience. Restarting a stream that has
+ * already played (e.g. ls_mixer_resume() after ls_mixer_stop()) is delayed by a few milliseconds, while the
+ * I/O thread decodes the start again; the channel holds its position meanwhile, and does the same if the
+ * I/O thread ever falls behind, so no part of the sound is skipped. Streamed sounds can't be converted with ls_mixer_resample() or used
+ * as impulse responses.
+ * 
+ * \param filename The path to the .ogg file.
+ * 
+ * \return The sound, to be played and deleted like one loaded with ls_mixer_load(), or NULL if the file can't be opened.
+ */
+ls_mixer_sounddata *ls_mixer_load_stream(const char *filename);
+
+/**
+ * \brief Builds the seek index of an OGG sound.
+ *
+ * Reads the position of every page of the file once, so that ls_mixer_seek() on channels playing the sound
+ * reads a single page and decodes forward to the exact frame, instead of searching the file. Channels and
+ * queues already playing the sound switch over to the new index, and a previous one is freed. This is worth it for long tracks that are seeked in, e.g. music or dialog. The index is a plain
+ * array of sound->seek_points entries in sound->seek_index, 8 bytes per page of usually 4 to 8 KB, which may
+ * also be stored with the asset and assigned back after loading (allocated with malloc(), ls_mixer_delete()
+ * frees it). WAV files need no index.
+ *
+ * \param sound A sound loaded via ls_mixer_load() or ls_mixer_load_stream()
+ *
+ * \return 0 on success, -1 if the sound is no OGG file.
+ */
+int ls_mixer_build_seek_index(ls_mixer_sounddata *sound);
+
+/**
+ * \brief Builds the mipmap of a sound for playing it at high pitch.
+ *
+ * Decodes the sound once and stores copies of it lowpassed and halved in rate, one octave down per level,
+ * up to a sixteenth of the rate. Channels playing the sound faster than twice its rate (through pitch,
+ * Doppler shift or a higher sample rate than the output) then read the copy that needs at most 2:1, so the
+ * sound doesn't alias at 4x or 8x pitch, and each channel costs the same at any pitch. The copies take about
+ * as much memory as the sound in 16 bit PCM, which OGG files otherwise don't need. Channels already playing
+ * the sound use the mipmap from their next audio block on. ls_mixer_resample() builds it again for the
+ * new rate and ls_mixer_delete() frees it.
+ *
+ * \param sound A sound loaded via ls_mixer_load()
+ *
+ * \return 0 on success, -1 if the sound is streamed or can't be decoded.
+ */
+int ls_mixer_build_mipmap(ls_mixer_sounddata *sound);
+
+/**
+ * \brief Sets the loop region of a sound.
+ *
+ * A sound played looped plays up to the loop end once and then repeats from the loop start, so it can have an
+ * intro that isn't repeated. The wrap is sample accurate and decoded ahead like the rest of the sound, for
+ * OGG files on the I/O thread, so it costs nothing on the audio thread. By default the region stored in the
+ * file is used: the first loop of the sampler chunk of a WAV file, or the LOOPSTART and LOOPLENGTH (or
+ * LOOPEND) comments of an OGG file, in frames. Without either a looped sound repeats as a whole. Sounds
+ * played without looping always play to the end of the file. The region is taken over by channels that start
+ * playing the sound afterwards.
+ *
+ * \param sound A sound loaded via ls_mixer_load() or ls_mixer_load_stream()
+ * \param start The loop start in seconds
+ * \param end The loop end in seconds, 0.0 to loop the whole sound, or -1.0 for both to use the region stored in the file
+ */
+void ls_mixer_set_loop_region(ls_mixer_sounddata *sound, double start, double end);
+
+/**
+ * \brief Converts sound data to the output sample rate.
+ *
+ * Decodes the sound and resamples it once to the sample rate of the audio device, replacing the loaded data.
+ * Sounds converted this way need no resampling at all while playing at pitch 1.0, at the cost of keeping
+ * OGG files in decoded form in memory. The loop region stored in the file is kept. Channels currently playing
+ * the sound are stopped.
+ * 
+ * \param sound A sound loaded via ls_mixer_load()
+ * 
+ * \return 0 on success, -1 if the sound could not be converted (the sound data is left unchanged).
+ */
+int ls_mixer_resample(ls_mixer_sounddata *sound);
+
 /**
  * \brief Delete sound data from memory.
  *
@@ -118,6 +311,56 @@ void ls_mixer_delete(ls_mixer_sounddata *sound);
  */
 int ls_mixer_play(ls_mixer_sounddata *sound,int loop, double gain, double pan, double pitch);
 
+/**
+ * \brief Plays a sound starting at an exact frame of the mixer clock.
+ *
+ * Like ls_mixer_play(), but the sound starts at mixer frame \p time, also in the middle of an audio block,
+ * so sounds scheduled against the same clock stay aligned to the sample. The channel is taken right away.
+ * A time that has already passed starts the sound with the next block.
+ * 
+ * \param sound A sound loaded via ls_mixer_load()
+ * \param time The mixer frame to start at, see ls_mixer_get_clock()
+ * \param loop Whether the sound should be looped (1) or not (0)
+ * \param gain Playback gain of the sound (1.0 = original, 2.0 = twice the amplitude, 0.0 = silent ...)
+ * \param pan The stereo position (0.0 = center 1.0 = full right, -1.0 = full left)
+ * \param pitch The playback speed like on a turntable (1.0 = original speed, 2.0 = twice as fast, 0.5 = half speed ...)
+ * 
+ * \return The index of the channel the sound is playing on.
+ */
+int ls_mixer_play_at(ls_mixer_sounddata *sound, uint64_t time, int loop, double gain, double pan, double pitch);
+
+/**
+ * \brief Queues a sound to play on a channel after the sounds already playing or queued there.
+ *
+ * The queued sound starts on the exact frame the sound before it ends, without a gap, or crossfades with its
+ * end. Its decoder is opened and the first frames decoded by this call, so it starts without delay. It takes
+ * over the gain, pan, pitch, interpolation, send level, bus and finished callback of the sound before it, and
+ * the channel index refers to it once the sound before has finished. A looping sound is never followed.
+ * 
+ * \param chan The index as returned by ls_mixer_play()
+ * \param sound A sound loaded via ls_mixer_load()
+ * \param crossfade Length in seconds of the equal-power crossfade with the end of the sound before, 0.0 for a gapless join
+ * \return 0 on success, -1 if nothing is playing on the channel
+ */
+int ls_mixer_queue(int chan, ls_mixer_sounddata *sound, double crossfade);
+
+/**
+ * \brief Removes all sounds queued on a channel, the playing one continues.
+ * \param chan The index as returned by ls_mixer_play()
+ */
+void ls_mixer_clear_queue(int chan);
+
+/**
+ * \brief Gets the mixer clock.
+ *
+ * The clock counts the frames mixed since ls_mixer_init() at the output sample rate. It only increases, by one
+ * audio block at a time, and can be read from any thread without locking. Schedule sounds at least a block
+ * ahead of it, e.g. ls_mixer_play_at(sound, ls_mixer_get_clock() + 2 * samples, ...).
+ *
+ * \return The mixer frame the next audio block starts at.
+ */
+uint64_t ls_mixer_get_clock(void);
+
 /**
  * \brief Pauses a channel.
 
@@ -131,7 +374,7 @@ void ls_mixer_pause(int chan);
  */
 void ls_mixer_resume(int chan);
 /**
- * \brief Stops playback on a channel.
+ * \brief Stops playback on a channel and removes the sounds queued on it.
 
  * \param chan The index as returned by ls_mixer_play()
  */
@@ -145,6 +388,18 @@ void ls_mixer_stop(int chan);
  */
 double ls_mixer_get_position(int chan);
 
+/**
+ * \brief Sets the playback position of a channel.
+ *
+ * The sound continues at the exact frame from the next audio block on; a paused or stopped channel starts
+ * there when resumed. OGG files are seeked faster with a seek index (see ls_mixer_build_seek_index()).
+ * Streamed sounds hold at the new position, playing silence, for the few milliseconds the I/O thread takes to
+ * decode from there.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param position The position in seconds from the start of the sound.
+ */
+void ls_mixer_seek(int chan, double position);
+
 /**
  * \brief Register callback function for a channel.
  * Register a callback function to be called when the playback on this channel has stopped.
@@ -183,6 +438,244 @@ void ls_mixer_set_gain(int chan,double gain);
  */
 void ls_mixer_set_pan(int chan,double pan);
 
+/**
+ * \brief Pans a channel by direction over the speaker layout (vector base amplitude panning).
+ * 
+ * The sound is folded down to mono. The speaker gains are only recalculated when this is called,
+ * so it is cheap to leave a direction set. Calling ls_mixer_set_pan() returns to stereo panning.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param azimuth Horizontal angle in degrees (0.0 = front, 90.0 = right, -90.0 = left, 180.0 = back)
+ * \param elevation Vertical angle in degrees (90.0 = above), an elevated sound spreads over all speakers
+ * \param spread Width of the sound in degrees (0.0 = point source, 360.0 = all around)
+ */
+void ls_mixer_set_direction(int chan, double azimuth, double elevation, double spread);
+
+/**
+ * \brief Sets how much of a channel is sent to the reverb.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param level Gain into the send bus, on top of the channel's gain (default 0.0 = dry)
+ */
+void ls_mixer_set_send(int chan, double level);
+
+/**
+ * \brief Sets the impulse response of the convolution reverb on the send bus.
+ * 
+ * The reverb has no latency. Its cost grows with the length of the impulse response (roughly 5% of a core
+ * for two seconds of stereo at 44.1 kHz), the impulse response isn't normalized, so use the send levels
+ * to set the amount of reverb. The sound may be freed with ls_mixer_delete() afterwards.
+ * \param ir Impulse response loaded with ls_mixer_load(), resampled to the output rate if needed, or NULL to remove the reverb
+ * \param threaded Whether to convolve the long tail on a separate thread, one block ahead of the audio callback
+ * \return 0 on success, -1 if the sound could not be decoded
+ */
+int ls_mixer_set_reverb(ls_mixer_sounddata *ir, int threaded);
+
+/**
+ * \brief Modes for ls_mixer_set_fdn_reverb()
+ * 
+ * The algorithmic reverb is off, reverberates the send bus (like ls_mixer_set_reverb()) or the whole mix.
+ */
+#define LS_MIXER_FDN_OFF CM_FDN_OFF
+#define LS_MIXER_FDN_SEND CM_FDN_SEND
+#define LS_MIXER_FDN_MASTER CM_FDN_MASTER
+
+/**
+ * \brief Sets up the cheap algorithmic reverb (a feedback delay network).
+ * 
+ * It costs a small fraction of the convolution reverb, independent of the reverb time, and can run together with it.
+ * \param mode One of LS_MIXER_FDN_OFF, LS_MIXER_FDN_SEND or LS_MIXER_FDN_MASTER
+ * \param rt60 Time in seconds for the reverb to decay by 60 dB
+ * \param damping Frequency in Hz above which the reverb decays faster, e.g. 4000.0. Values below 20.0 are raised
+ *                to 20.0; 0.0, or anything from 0.45 times the output sample rate up, turns the damping off
+ * \param size Scales the room (1.0 = medium hall, 0.3 = small room)
+ * \param wet Gain of the reverb
+ * \return 0 on success, -1 if out of memory
+ */
+int ls_mixer_set_fdn_reverb(int mode, double rt60, double damping, double size, double wet);
+
+/**
+ * \brief Index of the master bus, which every channel plays into by default.
+ */
+#define LS_MIXER_MASTER_BUS CM_MASTER_BUS
+
+/**
+ * \brief Creates a named submix bus.
+ * 
+ * Channels routed to a bus are mixed together, then the bus is filtered, run through its effect, scaled by
+ * its gain and mixed into its parent bus. Filtering a bus costs the same as filtering a single channel,
+ * so group channels that share a filter (e.g. "music", "sfx", "ui") instead of filtering each of them.
+ * Up to seven buses besides the master can be created, they last until the program ends.
+ * \param name Name to find the bus by with ls_mixer_get_bus()
+ * \param parent Bus this bus is mixed into, LS_MIXER_MASTER_BUS or another bus
+ * \return The index of the bus, -1 on error
+ */
+int ls_mixer_new_bus(const char *name, int parent);
+
+/**
+ * \brief Finds a bus by name.
+ * \param name The name passed to ls_mixer_new_bus() ("master" for the master bus)
+ * \return The index of the bus, -1 if there is none by that name
+ */
+int ls_mixer_get_bus(const char *name);
+
+/**
+ * \brief Routes a channel to a bus.
+ * 
+ * The send level (see ls_mixer_set_send()) is taken from the channel, before the bus.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param bus The index as returned by ls_mixer_new_bus(), or LS_MIXER_MASTER_BUS
+ */
+void ls_mixer_set_bus(int chan, int bus);
+
+/**
+ * \brief Sets the gain of a bus (1.0 by default, the master bus's is set by ls_mixer_set_gain(-1, ...)).
+ * \param bus The index as returned by ls_mixer_new_bus()
+ * \param gain The gain
+ */
+void ls_mixer_set_bus_gain(int bus, double gain);
+
+/**
+ * \brief Sets one stage of the IIR filter chain of a bus.
+ * 
+ * A bus has a chain of up to four filters that are run in order, stages that were never set pass the
+ * signal through. The master bus has a single stage, the one set by ls_mixer_set_iir(-1, ...).
+ * \param bus The index as returned by ls_mixer_new_bus()
+ * \param stage Position in the filter chain (0 to 3)
+ * \param b0 Feedforward filter coefficient
+ * \param b1 Feedforward filter coefficient
+ * \param b2 Feedforward filter coefficient
+ * \param a1 Feedback filter coefficient
+ * \param a2 Feedback filter coefficient
+ */
+void ls_mixer_set_bus_iir(int bus, int stage, double b0, double b1, double b2, double a1, double a2);
+
+/**
+ * \brief Sets one stage of the filter chain of a bus to a Butterworth lowpass of order one or two.
+ * \param bus The index as returned by ls_mixer_new_bus()
+ * \param stage Position in the filter chain (0 to 3)
+ * \param n Filter order (1 or 2)
+ * \param fc Cut off frequency in Hz
+ */
+void ls_mixer_set_bus_lowpass(int bus, int stage, int n, double fc);
+
+/**
+ * \brief Sets one stage of the filter chain of a bus to a Butterworth highpass of order one or two.
+ * \param bus The index as returned by ls_mixer_new_bus()
+ * \param stage Position in the filter chain (0 to 3)
+ * \param n Filter order (1 or 2)
+ * \param fc Cut off frequency in Hz
+ */
+void ls_mixer_set_bus_highpass(int bus, int stage, int n, double fc);
+
+/**
+ * \brief Removes all filters of a bus.
+ * \param bus The index as returned by ls_mixer_new_bus()
+ */
+void ls_mixer_clear_bus_filters(int bus);
+
+/**
+ * \brief Sets an effect on a bus.
+ * 
+ * The effect is called from the audio thread after the bus's filters, with the bus's interleaved samples
+ * (full scale is 32767.0) to process in place.
+ * \param bus The index as returned by ls_mixer_new_bus()
+ * \param effect Called with the samples, the number of frames, the number of channels and \p udata, or NULL
+ * \param udata Passed to \p effect
+ */
+void ls_mixer_set_bus_effect(int bus, void (*effect)(float*, int, int, void*), void *udata);
+
+/**
+ * \brief Ducks a bus under another one (sidechain compression).
+ * 
+ * While the peak level of the key bus is above the threshold, the ducked bus is turned down by a ratio of
+ * its excess, e.g. music under dialog. It is applied after the ducked bus's filters and effect.
+ * \param bus The bus to turn down, as returned by ls_mixer_new_bus()
+ * \param key The bus whose level controls the ducking, which must have been created after \p bus,
+ *            or -1 to stop ducking
+ * \param threshold Level of the key in dBFS above which the bus is ducked (e.g. -30.0)
+ * \param ratio How many dB the key has to rise for the ducking to let one dB more through (e.g. 4.0)
+ * \param attack Time in seconds the ducking takes to set in (e.g. 0.01)
+ * \param release Time in seconds the ducking takes to wear off (e.g. 0.3)
+ */
+void ls_mixer_set_bus_ducking(int bus, int key, double threshold, double ratio, double attack, double release);
+
+/**
+ * \brief Sets up the limiter at the end of the master path.
+ * 
+ * The limiter looks ahead to turn the mix down smoothly before a peak would clip, so the master gain can
+ * stay at 1.0. ls_mixer_init() enables it with a ceiling of -1.0 dBFS, 5 ms of look-ahead and a release of
+ * 0.1 s. The look-ahead adds to the output latency.
+ * \param ceiling Maximum output level in dBFS (at most 0.0)
+ * \param lookahead Look-ahead in seconds (at most 0.1), 0.0 disables the limiter
+ * \param release Time constant in seconds of the recovery after a peak
+ * \return 0 on success, -1 if out of memory
+ */
+int ls_mixer_set_limiter(double ceiling, double lookahead, double release);
+
+/**
+ * \brief Gets the current gain of the limiter.
+ * \return 1.0 if the limiter is idle or disabled, less while it turns the mix down
+ */
+double ls_mixer_get_limiter_gain(void);
+
+/**
+ * \brief Sets the speaker layout used by ls_mixer_set_direction().
+ * 
+ * The default layouts follow SDL's channel order: stereo at -30/30 degrees, quadrophonic at -45/45/-135/135,
+ * 5.1 at -30/30/0/LFE/-110/110 and 7.1 at -30/30/0/LFE/-150/150/-90/90. Call this before setting any directions.
+ * \param azimuth The azimuth in degrees of each output channel (two for mono output, which is mixed as stereo)
+ *                or LS_MIXER_SPEAKER_NONE
+ */
+void ls_mixer_set_speakers(const double *azimuth);
+
+/**
+ * \brief Positions a channel in 3D space.
+ * 
+ * Once per audio block the mixer works out the channel's distance attenuation, Doppler shift, air absorption
+ * and direction relative to the listener. These apply on top of the channel's gain, pitch and IIR filter.
+ * Calling ls_mixer_set_pan() or ls_mixer_set_direction()
+ * returns the channel to plain panning.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param position x, y and z of the emitter, must not be NULL
+ * \param velocity x, y and z of the emitter's velocity in units per second for the Doppler shift, or NULL
+ */
+void ls_mixer_set_emitter(int chan, const double *position, const double *velocity);
+
+/**
+ * \brief Sets how a positioned channel gets quieter with distance.
+ * \param chan The index as returned by ls_mixer_play()
+ * \param curve One of LS_MIXER_ROLLOFF_INVERSE (default), LS_MIXER_ROLLOFF_LINEAR or LS_MIXER_ROLLOFF_EXPONENTIAL
+ * \param min_distance Distance up to which the channel plays at full gain (default 1.0)
+ * \param max_distance Distance beyond which the channel gets no quieter (default 1000.0)
+ * \param rolloff Steepness of the curve (default 1.0)
+ */
+void ls_mixer_set_attenuation(int chan, int curve, double min_distance, double max_distance, double rolloff);
+
+/**
+ * \brief Sets the listener that positioned channels are heard by.
+ * 
+ * The default listener is at the origin, at rest, facing -z with y up.
+ * \param position x, y and z of the listener, or NULL for the origin
+ * \param velocity x, y and z of the listener's velocity in units per second, or NULL
+ * \param forward Direction the listener faces, or NULL
+ * \param up Direction of the top of the listener's head, or NULL
+ */
+void ls_mixer_set_listener(const double *position, const double *velocity, const double *forward, const double *up);
+
+/**
+ * \brief Sets the Doppler shift of positioned channels.
+ * \param speed_of_sound In units per second (default 343.3)
+ * \param factor Scales the velocities (default 1.0, 0.0 disables the Doppler shift)
+ */
+void ls_mixer_set_doppler(double speed_of_sound, double factor);
+
+/**
+ * \brief Sets the air absorption of positioned channels.
+ * 
+ * Distant channels are lowpass filtered, the cutoff starts at 20 kHz and halves every \p distance units.
+ * \param distance Distance over which the cutoff falls by an octave, 0.0 (default) disables the absorption
+ */
+void ls_mixer_set_air_absorption(double distance);
+
 /**
  * \brief Sets the pitch of a channel.
  * \param chan The index as returned by ls_mixer_play()
@@ -190,6 +683,16 @@ void ls_mixer_set_pan(int chan,double pan);
  */
 void ls_mixer_set_pitch(int chan,double pitch);
 
+/**
+ * \brief Sets the interpolation mode of a channel.
+ * 
+ * Chooses how the audio is resampled when the pitch or the sample rate of the sound differ from the output.
+ * 
+ * \param chan The index as returned by ls_mixer_play(), or -1 to set the mode for all sounds played afterwards
+ * \param interp One of LS_MIXER_INTERP_LINEAR (default), LS_MIXER_INTERP_CUBIC or LS_MIXER_INTERP_SINC
+ */
+void ls_mixer_set_interpolation(int chan, int interp);
+
 
 /**
  * \brief Sets the IIR filter coefficients of a channel.
@@ -0,0 +1,530 @@
+/*
+ *    Part of ls_mixer
+ *    Copyright (c) 2021-2022 Laurin Schnorr (laurin point schnorr at online point de)
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#include "reverb.h"
+
+#define MIN(a, b)         ((a) < (b) ? (a) : (b))
+
+
+/*============================================================================
+** Convolution
+**============================================================================*/
+
+/* The impulse response is split in three parts. The first HEAD_TAPS taps are
+** convolved directly, so there is no latency. Up to LARGE_BLOCK taps follows a
+** stage with partitions of SMALL_BLOCK frames, after that the tail with
+** partitions of LARGE_BLOCK frames. Each stage is uniformly partitioned
+** overlap-save: when a block of input is complete its spectrum goes into a
+** ring, and the output of the next block is the inverse transform of the sum
+** of the partition spectra times the input spectra of the blocks before. As a
+** stage's first partition starts one block in, that output is always due only
+** after the block it is computed at.
+**
+** The two channels are transformed together as the real and imaginary part of
+** one complex FFT, and separated into half spectra for the products. Spectra
+** are stored as separate real and imaginary arrays so the products vectorize.
+**
+** On a worker thread the tail stage computes the sum of all but its first
+** partition for the block after next, leaving it a whole block of time; the
+** audio thread only adds the first partition and transforms back. */
+
+#define HEAD_TAPS         (64)
+#define SMALL_BLOCK       (64)
+#define LARGE_BLOCK       (512)
+
+typedef struct {
+  int n;                /* Size of the transform */
+  int *bitrev;          /* Bit reversed index */
+  float *cos, *sin;     /* Twiddle factors, n / 2 each */
+} Fft;
+
+typedef struct {
+  int size;             /* Partition size, the FFT is twice as long */
+  int bins;             /* Bins in a half spectrum, size + 1 */
+  int parts;            /* Number of partitions, the first starts at `size` */
+  int pos;              /* Frames of the current block received */
+  int newest;           /* Ring slot of the newest input spectrum */
+  Fft fft;
+  float *window;        /* Previous and current block, interleaved stereo */
+  float *out;           /* Output of the current block, interleaved stereo */
+  float *h;             /* Partition spectra [parts][4][bins]: L re, L im, R re, R im */
+  float *x;             /* Ring of input spectra [parts][4][bins] */
+  float *acc;           /* Sum of products [4][bins] */
+  float *re, *im;       /* Transform buffers */
+} Stage;
+
+struct cm_Convolver {
+  float head[2][HEAD_TAPS];     /* Head taps in reverse order */
+  float line[2][2 * HEAD_TAPS]; /* Input history, each frame stored twice */
+  int idx;                      /* Position in `line` */
+  int nstages;
+  Stage stage[2];
+  /* Worker for the tail stage */
+  SDL_Thread *thread;
+  SDL_sem *start, *done;
+  int pending;                  /* Whether the worker is computing the next tail */
+  int quit;
+};
+
+
+static int fft_init(Fft *f, int n) {
+  int i, j, bits;
+  f->n = n;
+  f->bitrev = malloc(n * sizeof(*f->bitrev));
+  f->cos = malloc(n / 2 * sizeof(*f->cos));
+  f->sin = malloc(n / 2 * sizeof(*f->sin));
+  if (!f->bitrev || !f->cos || !f->sin) {
+    return -1;
+  }
+  for (bits = 0; (1 << bits) < n; bits++);
+  for (i = 0; i < n; i++) {
+    for (f->bitrev[i] = 0, j = 0; j < bits; j++) {
+      f->bitrev[i] |= ((i >> j) & 1) << (bits - 1 - j);
+    }
+  }
+  for (i = 0; i < n / 2; i++) {
+    f->cos[i] = cos(2.0 * M_PI * i / n);
+    f->sin[i] = sin(2.0 * M_PI * i / n);
+  }
+  return 0;
+}
+
+
+/* In-place radix-2 forward transform */
+static void fft(const Fft *f, float *re, float *im) {
+  int i, j, k, a, b, half, step, size, n = f->n;
+  float t, wr, wi, tr, ti;
+
+  for (i = 0; i < n; i++) {
+    j = f->bitrev[i];
+    if (i < j) {
+      t = re[i]; re[i] = re[j]; re[j] = t;
+      t = im[i]; im[i] = im[j]; im[j] = t;
+    }
+  }
+  for (size = 2; size <= n; size *= 2) {
+    half = size / 2;
+    step = n / size;
+    for (i = 0; i < n; i += size) {
+      for (k = 0; k < half; k++) {
+        wr = f->cos[k * step];
+        wi = -f->sin[k * step];
+        a = i + k;
+        b = a + half;
+        tr = re[b] * wr - im[b] * wi;
+        ti = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+
+/* Transform `2 * size` interleaved stereo frames into two half spectra */
+static void stage_transform(Stage *s, const float *frames, float *dst) {
+  int k, n = 2 * s->size;
+  float zr, zi, wr, wi;
+  for (k = 0; k < n; k++) {
+    s->re[k] = frames[2 * k];
+    s->im[k] = frames[2 * k + 1];
+  }
+  fft(&s->fft, s->re, s->im);
+  for (k = 0; k < s->bins; k++) {
+    zr = s->re[k];
+    zi = s->im[k];
+    wr = s->re[(n - k) % n];
+    wi = s->im[(n - k) % n];
+    dst[k              ] = 0.5f * (zr + wr);
+    dst[k + s->bins    ] = 0.5f * (zi - wi);
+    dst[k + s->bins * 2] = 0.5f * (zi + wi);
+    dst[k + s->bins * 3] = 0.5f * (wr - zr);
+  }
+}
+
+
+/* acc += h * x for both channels */
+static void complex_mac(float *acc, const float *h, const float *x, int bins) {
+  float *ar = acc, *ai = acc + bins;
+  const float *hr = h, *hi = h + bins, *xr = x, *xi = x + bins;
+  int k, c;
+  for (c = 0; c < 2; c++) {
+    for (k = 0; k < bins; k++) {
+      ar[k] += hr[k] * xr[k] - hi[k] * xi[k];
+      ai[k] += hr[k] * xi[k] + hi[k] * xr[k];
+    }
+    ar += 2 * bins; ai += 2 * bins;
+    hr += 2 * bins; hi += 2 * bins;
+    xr += 2 * bins; xi += 2 * bins;
+  }
+}
+
+
+/* Sum the products of partitions `from` to `to` for the block `lead` blocks
+** after the one following the newest input */
+static void stage_sum(Stage *s, int from, int to, int lead) {
+  int j, slot, stride = 4 * s->bins;
+  for (j = from; j <= to; j++) {
+    slot = ((s->newest - (j - 1 - lead)) % s->parts + s->parts) % s->parts;
+    complex_mac(s->acc, s->h + (j - 1) * stride, s->x + slot * stride, s->bins);
+  }
+}
+
+
+/* Transform the summed spectra back into the output of the next block */
+static void stage_output(Stage *s) {
+  int k, n = 2 * s->size, b = s->bins;
+  const float *lr = s->acc, *li = lr + b, *rr = li + b, *ri = rr + b;
+  /* Spectrum of L + iR, conjugated for the inverse transform */
+  for (k = 0; k < b; k++) {
+    s->re[k] = lr[k] - ri[k];
+    s->im[k] = -(li[k] + rr[k]);
+  }
+  for (k = b; k < n; k++) {
+    s->re[k] = lr[n - k] + ri[n - k];
+    s->im[k] = -(rr[n - k] - li[n - k]);
+  }
+  fft(&s->fft, s->re, s->im);
+  for (k = 0; k < s->size; k++) {
+    s->out[2 * k    ] = s->re[s->size + k];
+    s->out[2 * k + 1] = -s->im[s->size + k];
+  }
+}
+
+
+static int convolver_worker(void *udata) {
+  cm_Convolver *c = udata;
+  Stage *s = &c->stage[c->nstages - 1];
+  for (;;) {
+    SDL_SemWait(c->start);
+    if (c->quit) {
+      break;
+    }
+    stage_sum(s, 2, s->parts, 1);
+    SDL_SemPost(c->done);
+  }
+  return 0;
+}
+
+
+/* A block of the stage is complete */
+static void stage_block(cm_Convolver *c, Stage *s) {
+  int threaded = c->thread && s == &c->stage[c->nstages - 1];
+
+  /* The worker's sum for the coming block must be done before the ring moves */
+  if (threaded && c->pending) {
+    SDL_SemWait(c->done);
+    c->pending = 0;
+  }
+
+  /* Add the newest input spectrum and move on the window */
+  s->newest = (s->newest + 1) % s->parts;
+  stage_transform(s, s->window, s->x + s->newest * 4 * s->bins);
+  memcpy(s->window, s->window + 2 * s->size, 2 * s->size * sizeof(float));
+
+  if (!threaded) {
+    memset(s->acc, 0, 4 * s->bins * sizeof(float));
+    stage_sum(s, 2, s->parts, 0);
+  }
+  stage_sum(s, 1, 1, 0);
+  stage_output(s);
+
+  if (threaded && s->parts > 1) {
+    memset(s->acc, 0, 4 * s->bins * sizeof(float));
+    c->pending = 1;
+    SDL_SemPost(c->start);
+  }
+}
+
+
+static int stage_init(Stage *s, int size, int parts, const float *ir, int length) {
+  float *taps;
+  int j, k, n = 2 * size;
+
+  s->size = size;
+  s->bins = size + 1;
+  s->parts = parts;
+  s->newest = 0;
+  s->pos = 0;
+  s->window = calloc(2 * n, sizeof(float));
+  s->out = calloc(2 * size, sizeof(float));
+  s->h = calloc(parts * 4 * s->bins, sizeof(float));
+  s->x = calloc(parts * 4 * s->bins, sizeof(float));
+  s->acc = calloc(4 * s->bins, sizeof(float));
+  s->re = malloc(n * sizeof(float));
+  s->im = malloc(n * sizeof(float));
+  taps = malloc(2 * n * sizeof(float));
+  if (!s->window || !s->out || !s->h || !s->x || !s->acc || !s->re || !s->im || !taps
+      || fft_init(&s->fft, n) < 0) {
+    free(taps);
+    return -1;
+  }
+
+  /* Partition spectra, scaled for the unnormalized inverse transform */
+  for (j = 1; j <= parts; j++) {
+    memset(taps, 0, 2 * n * sizeof(float));
+    for (k = 0; k < size && j * size + k < length; k++) {
+      taps[2 * k    ] = ir[2 * (j * size + k)    ] / n;
+      taps[2 * k + 1] = ir[2 * (j * size + k) + 1] / n;
+    }
+    stage_transform(s, taps, s->h + (j - 1) * 4 * s->bins);
+  }
+  free(taps);
+  return 0;
+}
+
+
+static void stage_free(Stage *s) {
+  free(s->window);
+  free(s->out);
+  free(s->h);
+  free(s->x);
+  free(s->acc);
+  free(s->re);
+  free(s->im);
+  free(s->fft.bitrev);
+  free(s->fft.cos);
+  free(s->fft.sin);
+}
+
+
+cm_Convolver* cm_convolver_new(const float *ir, int length, int threaded) {
+  cm_Convolver *c = calloc(1, sizeof(*c));
+  int k, end;
+  if (!c) {
+    return NULL;
+  }
+
+  for (k = 0; k < HEAD_TAPS && k < length; k++) {
+    c->head[0][HEAD_TAPS - 1 - k] = ir[2 * k];
+    c->head[1][HEAD_TAPS - 1 - k] = ir[2 * k + 1];
+  }
+  if (length > SMALL_BLOCK) {
+    end = MIN(length, LARGE_BLOCK);
+    if (stage_init(&c->stage[c->nstages++], SMALL_BLOCK, (end + SMALL_BLOCK - 1) / SMALL_BLOCK - 1, ir, length) < 0) {
+      goto fail;
+    }
+  }
+  if (length > LARGE_BLOCK) {
+    if (stage_init(&c->stage[c->nstages++], LARGE_BLOCK, (length + LARGE_BLOCK - 1) / LARGE_BLOCK - 1, ir, length) < 0) {
+      goto fail;
+    }
+  }
+
+  if (threaded && c->nstages > 0 && c->stage[c->nstages - 1].parts > 1) {
+    c->start = SDL_CreateSemaphore(0);
+    c->done = SDL_CreateSemaphore(0);
+    c->thread = SDL_CreateThread(convolver_worker, "cm_convolver", c);
+  }
+  return c;
+
+fail:
+  cm_convolver_destroy(c);
+  return NULL;
+}
+
+
+void cm_convolver_process(cm_Convolver *c, const float *in, float *out, int frames) {
+  Stage *s;
+  float l, r, yl, yr;
+  const float *wl, *wr;
+  int i, k, n;
+
+  for (i = 0; i < frames; i++) {
+    l = in[2 * i];
+    r = in[2 * i + 1];
+
+    /* Head */
+    c->idx = (c->idx + 1) % HEAD_TAPS;
+    c->line[0][c->idx] = c->line[0][c->idx + HEAD_TAPS] = l;
+    c->line[1][c->idx] = c->line[1][c->idx + HEAD_TAPS] = r;
+    wl = c->line[0] + c->idx + 1;
+    wr = c->line[1] + c->idx + 1;
+    yl = yr = 0.0f;
+    for (k = 0; k < HEAD_TAPS; k++) {
+      yl += c->head[0][k] * wl[k];
+      yr += c->head[1][k] * wr[k];
+    }
+
+    /* Partitioned stages */
+    for (n = 0; n < c->nstages; n++) {
+      s = &c->stage[n];
+      s->window[2 * (s->size + s->pos)    ] = l;
+      s->window[2 * (s->size + s->pos) + 1] = r;
+      yl += s->out[2 * s->pos];
+      yr += s->out[2 * s->pos + 1];
+      if (++s->pos == s->size) {
+        stage_block(c, s);
+        s->pos = 0;
+      }
+    }
+
+    out[2 * i] = yl;
+    out[2 * i + 1] = yr;
+  }
+}
+
+
+void cm_convolver_destroy(cm_Convolver *c) {
+  int n;
+  if (c->thread) {
+    if (c->pending) {
+      SDL_SemWait(c->done);
+    }
+    c->quit = 1;
+    SDL_SemPost(c->start);
+    SDL_WaitThread(c->thread, NULL);
+  }
+  if (c->start) SDL_DestroySemaphore(c->start);
+  if (c->done) SDL_DestroySemaphore(c->done);
+  for (n = 0; n < c->nstages; n++) {
+    stage_free(&c->stage[n]);
+  }
+  free(c);
+}
+
+
+/*============================================================================
+** Feedback delay network
+**============================================================================*/
+
+/* Each line's output is damped by a lowpass, scaled so it decays by 60 dB in
+** `rt60` seconds over its own length, mixed with the others through an
+** orthogonal Hadamard matrix (a fast Walsh-Hadamard transform) and fed back
+** with the input. The left input feeds the even lines and the right input
+** the odd ones, which also make up the two outputs. All steps are loops over
+** the lines, and the damping filters are the mixer's stereo biquads, one for
+** each pair of lines. The delay lines are power-of-two rings. */
+
+#define FDN_LINES         (8)
+
+struct cm_Fdn {
+  float *line[FDN_LINES];       /* Delay line rings */
+  int length[FDN_LINES];        /* Delay in frames */
+  int mask;                     /* Ring size - 1 */
+  int pos;                      /* Write position */
+  float gain[FDN_LINES];        /* Decay per trip through the line */
+  cm_Biquad damp[FDN_LINES / 2];
+};
+
+/* Delays in milliseconds at size 1.0, chosen without common divisors */
+static const double fdn_delays[FDN_LINES] = { 29.7, 37.1, 41.1, 43.7, 53.3, 59.9, 67.1, 73.3 };
+
+
+cm_Fdn* cm_fdn_new(int samplerate, double rt60, double damping, double size) {
+  cm_Fdn *f = calloc(1, sizeof(*f));
+  double w, c, alpha, a0;
+  int i, n, ring = 1;
+  if (!f) {
+    return NULL;
+  }
+
+  for (i = 0; i < FDN_LINES; i++) {
+    n = fdn_delays[i] * 1e-3 * size * samplerate;
+    f->length[i] = n < 1 ? 1 : n;
+    while (ring <= f->length[i]) ring *= 2;
+    f->gain[i] = pow(10.0, -3.0 * f->length[i] / (rt60 * samplerate));
+  }
+  f->mask = ring - 1;
+  for (i = 0; i < FDN_LINES; i++) {
+    f->line[i] = calloc(ring, sizeof(float));
+    if (!f->line[i]) {
+      cm_fdn_destroy(f);
+      return NULL;
+    }
+  }
+
+  /* Second order Butterworth lowpass, a bypass for 0 and near the Nyquist
+  ** frequency. Below 20 Hz the reverb would hardly be heard at all */
+  for (i = 0; i < FDN_LINES / 2; i++) {
+    memset(&f->damp[i], 0, sizeof(f->damp[i]));
+    f->damp[i].b0 = 1.0;
+    if (damping > 0.0 && damping < 0.45 * samplerate) {
+      w = 2.0 * M_PI * (damping < 20.0 ? 20.0 : damping) / samplerate;
+      c = cos(w);
+      alpha = sin(w) / M_SQRT2;
+      a0 = 1.0 + alpha;
+      f->damp[i].b0 = 0.5 * (1.0 - c) / a0;
+      f->damp[i].b1 = (1.0 - c) / a0;
+      f->damp[i].b2 = 0.5 * (1.0 - c) / a0;
+      f->damp[i].a1 = -2.0 * c / a0;
+      f->damp[i].a2 = (1.0 - alpha) / a0;
+    }
+  }
+  return f;
+}
+
+
+void cm_fdn_process(cm_Fdn *f, const float *in, float *out, int frames) {
+  float x[FDN_LINES], t;
+  double yl, yr;
+  int i, k, h;
+
+  for (i = 0; i < frames; i++) {
+    /* Read and damp */
+    for (k = 0; k < FDN_LINES; k++) {
+      x[k] = f->line[k][(f->pos - f->length[k]) & f->mask];
+    }
+    for (k = 0; k < FDN_LINES; k += 2) {
+      cm_process_iir(&f->damp[k / 2], x[k], x[k + 1], &yl, &yr);
+      x[k] = yl;
+      x[k + 1] = yr;
+    }
+    for (k = 0; k < FDN_LINES; k++) {
+      x[k] *= f->gain[k];
+    }
+
+    /* Outputs before mixing */
+    out[2 * i] = out[2 * i + 1] = 0.0f;
+    for (k = 0; k < FDN_LINES; k += 2) {
+      out[2 * i    ] += x[k];
+      out[2 * i + 1] += x[k + 1];
+    }
+
+    /* Mix, feed back and add the input */
+    for (h = 1; h < FDN_LINES; h *= 2) {
+      for (k = 0; k < FDN_LINES; k++) {
+        if (!(k & h)) {
+          t = x[k];
+          x[k] = t + x[k + h];
+          x[k + h] = t - x[k + h];
+        }
+      }
+    }
+    for (k = 0; k < FDN_LINES; k++) {
+      f->line[k][f->pos] = x[k] * (float) (1.0 / 2.8284271247461903) + in[2 * i + (k & 1)];
+    }
+    f->pos = (f->pos + 1) & f->mask;
+  }
+}
+
+
+void cm_fdn_destroy(cm_Fdn *f) {
+  int i;
+  for (i = 0; i < FDN_LINES; i++) {
+    free(f->line[i]);
+  }
+  free(f);
+}
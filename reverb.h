@@ -0,0 +1,46 @@
+/*
+ *    Part of ls_mixer
+ *    Copyright (c) 2021-2022 Laurin Schnorr (laurin point schnorr at online point de)
+ *
+ *    This program is free software: you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation, either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Reverb engines for the mixer's send bus or master path. All of them work on
+** interleaved stereo float blocks of any length and write the wet signal only. */
+
+#ifndef REVERB_H
+#define REVERB_H
+
+#include "cmixer.h"
+
+typedef struct cm_Convolver cm_Convolver;
+typedef struct cm_Fdn cm_Fdn;
+
+/* Zero latency convolution with a stereo impulse response of `length` frames.
+** The first taps are convolved directly and the rest in uniformly partitioned
+** FFT stages; with `threaded` set the long tail is computed on a worker thread
+** one block ahead. Returns NULL if out of memory. */
+cm_Convolver* cm_convolver_new(const float *ir, int length, int threaded);
+void cm_convolver_process(cm_Convolver *c, const float *in, float *out, int frames);
+void cm_convolver_destroy(cm_Convolver *c);
+
+/* Feedback delay network of eight delay lines. `rt60` is the time in
+** seconds to decay by 60 dB, above `damping` Hz it decays faster (0 for no
+** damping, at least 20 Hz otherwise), and `size` scales the delay lengths
+** (1.0 = a medium hall). Returns NULL if out of memory. */
+cm_Fdn* cm_fdn_new(int samplerate, double rt60, double damping, double size);
+void cm_fdn_process(cm_Fdn *f, const float *in, float *out, int frames);
+void cm_fdn_destroy(cm_Fdn *f);
+
+#endif
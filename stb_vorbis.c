@@ -299,6 +299,23 @@ extern int stb_vorbis_seek(stb_vorbis *f, unsigned int sample_number);
 extern int stb_vorbis_seek_start(stb_vorbis *f);
 // this function is equivalent to stb_vorbis_seek(f,0)
 
+typedef struct
+{
+   unsigned int offset;       // file offset of the page
+   unsigned int last_sample;  // granule position of the last sample ending on it
+} stb_vorbis_page;
+
+extern int stb_vorbis_build_page_index(stb_vorbis *f, stb_vorbis_page *pages, int max_pages);
+// (LS) scan every audio page of the stream and record its offset and granule
+// position in 'pages' (up to 'max_pages' entries). returns the number of
+// pages found, so call it with pages == NULL first to size the array. the
+// read position is left unchanged.
+
+extern void stb_vorbis_set_page_index(stb_vorbis *f, const stb_vorbis_page *pages, int num_pages);
+// (LS) use a page index from stb_vorbis_build_page_index() for seeking; a
+// seek then reads a single page instead of bisecting the file. the array
+// is not copied and must outlive 'f' or be unset by passing NULL.
+
 extern unsigned int stb_vorbis_stream_length_in_samples(stb_vorbis *f);
 extern float        stb_vorbis_stream_length_in_seconds(stb_vorbis *f);
 // these functions return the total length of the vorbis stream
@@ -313,6 +330,19 @@ extern int stb_vorbis_get_frame_float(stb_vorbis *f, int *channels, float ***out
 // You generally should not intermix calls to stb_vorbis_get_frame_*()
 // and stb_vorbis_get_samples_*(), since the latter calls the former.
 
+extern int stb_vorbis_get_samples_float_pointers(stb_vorbis *f, float ***output, int num_samples);
+// (LS) like stb_vorbis_get_samples_float(), but instead of copying the
+// samples *output is pointed at them in the decoder's own buffers, one
+// float* per channel. returns up to num_samples samples per channel, fewer
+// where a frame ends, and 0 at the end of the stream. the pointers are valid
+// until the next call; it can be intermixed with stb_vorbis_get_samples_*().
+// stb_vorbis_convert_short_interleaved() turns them into 16-bit samples.
+
+extern void stb_vorbis_set_simd(int enable);
+// (LS) use the SSE2 code paths (the default where they are compiled in) or
+// the scalar ones, for all decoders. both give identical output; this is
+// for comparing them
+
 #ifndef STB_VORBIS_NO_INTEGER_CONVERSION
 extern int stb_vorbis_get_frame_short_interleaved(stb_vorbis *f, int num_c, short *buffer, int num_shorts);
 extern int stb_vorbis_get_frame_short            (stb_vorbis *f, int num_c, short **buffer, int num_samples);
@@ -359,6 +389,13 @@ extern int stb_vorbis_get_samples_short(stb_vorbis *f, int channels, short **buf
 // it may be less than requested at the end of the file. If there are no more
 // samples in the file, returns 0.
 
+#ifndef STB_VORBIS_NO_INTEGER_CONVERSION
+extern void stb_vorbis_convert_short_interleaved(int channels, short *buffer, float **data, int num_samples);
+// (LS) convert num_samples samples of 'channels' float buffers, such as the
+// ones from stb_vorbis_get_samples_float_pointers(), to interleaved shorts
+// with the rounding and clamping of the _short_ functions above
+#endif
+
 #endif
 
 ////////   ERROR CODES
@@ -440,6 +477,13 @@ enum STBVorbisError
 //      most platforms which requires endianness be defined correctly.
 //#define STB_VORBIS_NO_FAST_SCALED_FLOAT
 
+// STB_VORBIS_NO_SIMD
+//     (LS) does not compile the SSE2 versions of the inverse MDCT, the
+//     windowing, the inverse coupling and the float-to-int conversion. they
+//     are built when the compiler targets SSE2 and produce the same bits as
+//     the scalar code; stb_vorbis_set_simd() switches between them at runtime
+// #define STB_VORBIS_NO_SIMD
+
 
 // STB_VORBIS_MAX_CHANNELS [number]
 //     globally define this to the maximum number of channels you need.
@@ -592,6 +636,11 @@ enum STBVorbisError
 
 #include <limits.h>
 
+#if !defined(STB_VORBIS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+   #define STB_VORBIS_SSE2
+   #include <emmintrin.h>
+#endif
+
 #ifdef __MINGW32__
    // eff you mingw:
    //     "fixed":
@@ -804,6 +853,10 @@ struct stb_vorbis
    // (but not necessarily the page on which it starts)
    ProbedPage p_first, p_last;
 
+   // (LS) optional page index used instead of the bisection search
+   const stb_vorbis_page *page_index;
+   int page_index_len;
+
   // memory management
    stb_vorbis_alloc alloc;
    int setup_offset;
@@ -2390,11 +2443,263 @@ void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 #endif
 
 
+// (LS) see stb_vorbis_set_simd()
+static int stb_vorbis_simd = 1;
+
+void stb_vorbis_set_simd(int enable)
+{
+   stb_vorbis_simd = enable;
+}
+
+#ifdef STB_VORBIS_SSE2
+// (LS) SSE2 versions of the inverse MDCT steps below. every lane does the
+// same operations in the same order as the scalar code, with x - y*a done
+// as x + y*(-a), so the results are identical as long as the compiler
+// doesn't contract the scalar code into FMAs. lane 0 is the lowest address,
+// so for the loops that walk downwards a vector holds z[-3],z[-2],z[-1],z[0]
+
+// flips the sign of the lanes marked with 1
+#define SSE_SIGNS(l0,l1,l2,l3)  _mm_set_ps((l3) ? -0.0f : 0.0f, (l2) ? -0.0f : 0.0f, (l1) ? -0.0f : 0.0f, (l0) ? -0.0f : 0.0f)
+#define SSE_SWAP_PAIRS(x)       _mm_shuffle_ps(x, x, _MM_SHUFFLE(2,3,0,1))
+
+// twiddles for two pairs: p (A[0],A[1]) for the upper lanes, q for the lower
+static __forceinline void imdct_twiddles_sse(__m128 *c, __m128 *s, float *p, float *q)
+{
+   __m128 t = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (__m64 const *) q), (__m64 const *) p);
+   *c = _mm_shuffle_ps(t, t, _MM_SHUFFLE(2,2,0,0));
+   *s = _mm_xor_ps(_mm_shuffle_ps(t, t, _MM_SHUFFLE(3,3,1,1)), SSE_SIGNS(0,1,0,1));
+}
+
+// ee0[-3..0] += ee2[-3..0]; ee2[-3..0] = the difference, rotated
+static __forceinline void imdct_butterfly_sse(float *ee0, float *ee2, __m128 c, __m128 s)
+{
+   __m128 a = _mm_loadu_ps(ee0 - 3);
+   __m128 b = _mm_loadu_ps(ee2 - 3);
+   __m128 d = _mm_sub_ps(a, b);
+   _mm_storeu_ps(ee0 - 3, _mm_add_ps(a, b));
+   _mm_storeu_ps(ee2 - 3, _mm_add_ps(_mm_mul_ps(d, c), _mm_mul_ps(SSE_SWAP_PAIRS(d), s)));
+}
+
+// the step 3 loops only run when |k_off| >= 8, so ee0[-7..0] and
+// ee2[-7..0] never overlap within an iteration
+
+static void imdct_step3_iter0_loop_sse(int n, float *e, int i_off, int k_off, float *A)
+{
+   float *ee0 = e + i_off;
+   float *ee2 = ee0 + k_off;
+   __m128 c, s;
+   int i;
+
+   for (i=(n>>2); i > 0; --i) {
+      imdct_twiddles_sse(&c, &s, A, A + 8);
+      imdct_butterfly_sse(ee0, ee2, c, s);
+      imdct_twiddles_sse(&c, &s, A + 16, A + 24);
+      imdct_butterfly_sse(ee0 - 4, ee2 - 4, c, s);
+      A += 32;
+      ee0 -= 8;
+      ee2 -= 8;
+   }
+}
+
+static void imdct_step3_inner_r_loop_sse(int lim, float *e, int d0, int k_off, float *A, int k1)
+{
+   float *e0 = e + d0;
+   float *e2 = e0 + k_off;
+   __m128 c, s;
+   int i;
+
+   for (i=lim >> 2; i > 0; --i) {
+      imdct_twiddles_sse(&c, &s, A, A + k1);
+      imdct_butterfly_sse(e0, e2, c, s);
+      imdct_twiddles_sse(&c, &s, A + k1*2, A + k1*3);
+      imdct_butterfly_sse(e0 - 4, e2 - 4, c, s);
+      A += k1*4;
+      e0 -= 8;
+      e2 -= 8;
+   }
+}
+
+static void imdct_step3_inner_s_loop_sse(int n, float *e, int i_off, int k_off, float *A, int a_off, int k0)
+{
+   float *ee0 = e  +i_off;
+   float *ee2 = ee0+k_off;
+   __m128 c0, s0, c1, s1;
+   int i;
+
+   imdct_twiddles_sse(&c0, &s0, A, A + a_off);
+   imdct_twiddles_sse(&c1, &s1, A + a_off*2, A + a_off*3);
+   for (i=n; i > 0; --i) {
+      imdct_butterfly_sse(ee0, ee2, c0, s0);
+      imdct_butterfly_sse(ee0 - 4, ee2 - 4, c1, s1);
+      ee0 -= k0;
+      ee2 -= k0;
+   }
+}
+
+// iter_54 on z[-7..0], given as hi = z[-3..0] and lo = z[-7..-4]
+static __forceinline void iter_54_sse(__m128 *hi, __m128 *lo)
+{
+   __m128 y = _mm_add_ps(*hi, *lo); // y3 y2 y1 y0
+   __m128 k = _mm_sub_ps(*hi, *lo); // k33 k22 k11 k00
+   *hi = _mm_add_ps(_mm_shuffle_ps(y, y, _MM_SHUFFLE(3,2,3,2)),
+                    _mm_xor_ps(_mm_shuffle_ps(y, y, _MM_SHUFFLE(1,0,1,0)), SSE_SIGNS(1,1,0,0)));
+   *lo = _mm_add_ps(_mm_shuffle_ps(k, k, _MM_SHUFFLE(3,2,3,2)),
+                    _mm_xor_ps(_mm_shuffle_ps(k, k, _MM_SHUFFLE(0,1,0,1)), SSE_SIGNS(0,1,1,0)));
+}
+
+static void imdct_step3_inner_s_loop_ld654_sse(int n, float *e, int i_off, float *A, int base_n)
+{
+   int a_off = base_n >> 3;
+   __m128 A2 = _mm_set1_ps(A[0+a_off]);
+   float *z = e + i_off;
+   float *base = z - 16 * n;
+
+   while (z > base) {
+      __m128 z0 = _mm_loadu_ps(z -  3);
+      __m128 z1 = _mm_loadu_ps(z -  7);
+      __m128 z2 = _mm_loadu_ps(z - 11);
+      __m128 z3 = _mm_loadu_ps(z - 15);
+      __m128 d, t, u;
+
+      // z[-8..-11]: z[-8],z[-9] as they are, then (k00+k11)*A2, (k11-k00)*A2
+      d  = _mm_sub_ps(z0, z2);
+      t  = _mm_mul_ps(_mm_add_ps(d, _mm_xor_ps(SSE_SWAP_PAIRS(d), SSE_SIGNS(1,0,0,0))), A2);
+      z0 = _mm_add_ps(z0, z2);
+      z2 = _mm_shuffle_ps(t, d, _MM_SHUFFLE(3,2,1,0));
+
+      // z[-12..-15]: the reversed differences come out negated
+      d  = _mm_sub_ps(z1, z3);
+      u  = SSE_SWAP_PAIRS(d);
+      t  = _mm_mul_ps(_mm_add_ps(u, _mm_xor_ps(d, SSE_SIGNS(0,1,0,0))), A2);
+      z1 = _mm_add_ps(z1, z3);
+      z3 = _mm_xor_ps(_mm_shuffle_ps(t, u, _MM_SHUFFLE(3,2,1,0)), SSE_SIGNS(1,0,1,0));
+
+      iter_54_sse(&z0, &z1);
+      iter_54_sse(&z2, &z3);
+      _mm_storeu_ps(z -  3, z0);
+      _mm_storeu_ps(z -  7, z1);
+      _mm_storeu_ps(z - 11, z2);
+      _mm_storeu_ps(z - 15, z3);
+      z -= 16;
+   }
+}
+
+// copy and reflect spectral data, step 0; two iterations per vector
+static void imdct_step0_sse(float *buf2, float *buffer, float *A, int n)
+{
+   int n2 = n >> 1;
+   float *d = &buf2[n2-4], *e = buffer, *AA = A, *e_stop = &buffer[n2];
+
+   while (e != e_stop) {
+      __m128 lo = _mm_loadu_ps(e), hi = _mm_loadu_ps(e + 4), a = _mm_loadu_ps(AA);
+      __m128 p  = _mm_shuffle_ps(hi, lo, _MM_SHUFFLE(0,0,0,0));
+      __m128 q  = _mm_shuffle_ps(hi, lo, _MM_SHUFFLE(2,2,2,2));
+      __m128 ca = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0,1,2,3));
+      __m128 cb = _mm_xor_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1,0,3,2)), SSE_SIGNS(0,1,0,1));
+      _mm_storeu_ps(d, _mm_add_ps(_mm_mul_ps(p, ca), _mm_mul_ps(q, cb)));
+      d -= 4;
+      AA += 4;
+      e += 8;
+   }
+
+   e = &buffer[n2-3];
+   while (d >= buf2) {
+      __m128 lo = _mm_loadu_ps(e - 4), hi = _mm_loadu_ps(e), a = _mm_loadu_ps(AA);
+      __m128 p  = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(0,0,0,0));
+      __m128 q  = _mm_xor_ps(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,2,2,2)), SSE_SIGNS(1,1,1,1));
+      __m128 ca = _mm_shuffle_ps(a, a, _MM_SHUFFLE(0,1,2,3));
+      __m128 cb = _mm_xor_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1,0,3,2)), SSE_SIGNS(1,0,1,0));
+      _mm_storeu_ps(d, _mm_add_ps(_mm_mul_ps(q, ca), _mm_mul_ps(p, cb)));
+      d -= 4;
+      AA += 4;
+      e -= 8;
+   }
+}
+
+static void imdct_step2_sse(float *u, float *v, float *A, int n)
+{
+   int n2 = n >> 1, n4 = n >> 2;
+   float *AA = &A[n2-8];
+   float *d0 = &u[n4], *d1 = &u[0], *e0 = &v[n4], *e1 = &v[0];
+
+   while (AA >= A) {
+      __m128 a = _mm_loadu_ps(e0), b = _mm_loadu_ps(e1), c, s, d;
+      imdct_twiddles_sse(&c, &s, AA, AA + 4);
+      d = _mm_sub_ps(a, b);
+      _mm_storeu_ps(d0, _mm_add_ps(a, b));
+      _mm_storeu_ps(d1, _mm_add_ps(_mm_mul_ps(d, c), _mm_mul_ps(SSE_SWAP_PAIRS(d), s)));
+      AA -= 8;
+      d0 += 4;
+      d1 += 4;
+      e0 += 4;
+      e1 += 4;
+   }
+}
+
+static void imdct_step7_sse(float *v, float *C, int n)
+{
+   int n2 = n >> 1;
+   float *d = v, *e = v + n2 - 4;
+
+   while (d < e) {
+      __m128 dv = _mm_loadu_ps(d), c = _mm_loadu_ps(C);
+      __m128 ev = _mm_loadu_ps(e);
+      __m128 er = _mm_shuffle_ps(ev, ev, _MM_SHUFFLE(1,0,3,2));          // e2 e3 e0 e1
+      __m128 a  = _mm_add_ps(dv, _mm_xor_ps(er, SSE_SIGNS(1,0,1,0)));     // a02 a11
+      __m128 c1 = _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,1,1));
+      __m128 c0 = _mm_xor_ps(_mm_shuffle_ps(c, c, _MM_SHUFFLE(2,2,0,0)), SSE_SIGNS(0,1,0,1));
+      __m128 b  = _mm_add_ps(_mm_mul_ps(c1, a), _mm_mul_ps(c0, SSE_SWAP_PAIRS(a))); // b0 b1
+      __m128 b2 = _mm_add_ps(dv, _mm_xor_ps(er, SSE_SIGNS(0,1,0,1)));     // b2 b3
+      __m128 t  = _mm_xor_ps(_mm_sub_ps(b2, b), SSE_SIGNS(0,1,0,1));
+      _mm_storeu_ps(d, _mm_add_ps(b2, b));
+      _mm_storeu_ps(e, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1,0,3,2)));
+      C += 4;
+      d += 4;
+      e -= 4;
+   }
+}
+
+static void imdct_step8_sse(float *buffer, float *v, float *B, int n)
+{
+   int n2 = n >> 1;
+   float *e = v + n2 - 8;
+   float *d0 = &buffer[0], *d1 = &buffer[n2-4], *d2 = &buffer[n2], *d3 = &buffer[n-4];
+
+   B += n2 - 8;
+   while (e >= v) {
+      __m128 e_lo = _mm_loadu_ps(e), e_hi = _mm_loadu_ps(e + 4);
+      __m128 b_lo = _mm_loadu_ps(B), b_hi = _mm_loadu_ps(B + 4);
+      __m128 ee = _mm_shuffle_ps(e_lo, e_hi, _MM_SHUFFLE(2,0,2,0));
+      __m128 eo = _mm_shuffle_ps(e_lo, e_hi, _MM_SHUFFLE(3,1,3,1));
+      __m128 be = _mm_shuffle_ps(b_lo, b_hi, _MM_SHUFFLE(2,0,2,0));
+      __m128 bo = _mm_shuffle_ps(b_lo, b_hi, _MM_SHUFFLE(3,1,3,1));
+      __m128 p_odd  = _mm_sub_ps(_mm_mul_ps(ee, bo), _mm_mul_ps(eo, be));
+      __m128 p_even = _mm_sub_ps(_mm_xor_ps(_mm_mul_ps(ee, be), SSE_SIGNS(1,1,1,1)), _mm_mul_ps(eo, bo));
+      _mm_storeu_ps(d0, _mm_shuffle_ps(p_odd, p_odd, _MM_SHUFFLE(0,1,2,3)));
+      _mm_storeu_ps(d1, _mm_xor_ps(p_odd, SSE_SIGNS(1,1,1,1)));
+      _mm_storeu_ps(d2, _mm_shuffle_ps(p_even, p_even, _MM_SHUFFLE(0,1,2,3)));
+      _mm_storeu_ps(d3, p_even);
+      B -= 8;
+      e -= 8;
+      d0 += 4;
+      d2 += 4;
+      d1 -= 4;
+      d3 -= 4;
+   }
+}
+#endif // STB_VORBIS_SSE2
+
 // the following were split out into separate functions while optimizing;
 // they could be pushed back up but eh. __forceinline showed no change;
 // they're probably already being inlined.
 static void imdct_step3_iter0_loop(int n, float *e, int i_off, int k_off, float *A)
 {
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd) {
+      imdct_step3_iter0_loop_sse(n, e, i_off, k_off, A);
+      return;
+   }
+#endif
    float *ee0 = e + i_off;
    float *ee2 = ee0 + k_off;
    int i;
@@ -2440,6 +2745,12 @@ static void imdct_step3_iter0_loop(int n, float *e, int i_off, int k_off, float
 
 static void imdct_step3_inner_r_loop(int lim, float *e, int d0, int k_off, float *A, int k1)
 {
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd) {
+      imdct_step3_inner_r_loop_sse(lim, e, d0, k_off, A, k1);
+      return;
+   }
+#endif
    int i;
    float k00_20, k01_21;
 
@@ -2490,6 +2801,12 @@ static void imdct_step3_inner_r_loop(int lim, float *e, int d0, int k_off, float
 
 static void imdct_step3_inner_s_loop(int n, float *e, int i_off, int k_off, float *A, int a_off, int k0)
 {
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd) {
+      imdct_step3_inner_s_loop_sse(n, e, i_off, k_off, A, a_off, k0);
+      return;
+   }
+#endif
    int i;
    float A0 = A[0];
    float A1 = A[0+1];
@@ -2573,6 +2890,12 @@ static __forceinline void iter_54(float *z)
 
 static void imdct_step3_inner_s_loop_ld654(int n, float *e, int i_off, float *A, int base_n)
 {
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd) {
+      imdct_step3_inner_s_loop_ld654_sse(n, e, i_off, A, base_n);
+      return;
+   }
+#endif
    int a_off = base_n >> 3;
    float A2 = A[0+a_off];
    float *z = e + i_off;
@@ -2645,6 +2968,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
    // this propagates through linearly to the end, where the numbers
    // are 1/2 too small, and need to be compensated for.
 
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd)
+      imdct_step0_sse(buf2, buffer, A, n);
+   else
+#endif
    {
       float *d,*e, *AA, *e_stop;
       d = &buf2[n2-2];
@@ -2679,6 +3007,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
    // step 2    (paper output is w, now u)
    // this could be in place, but the data ends up in the wrong
    // place... _somebody_'s got to swap it, so this is nominated
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd)
+      imdct_step2_sse(u, v, A, n);
+   else
+#endif
    {
       float *AA = &A[n2-8];
       float *d0,*d1, *e0, *e1;
@@ -2806,6 +3139,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 
    // step 7   (paper output is v, now v)
    // this is now in place
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd)
+      imdct_step7_sse(v, f->C[blocktype], n);
+   else
+#endif
    {
       float *C = f->C[blocktype];
       float *d, *e;
@@ -2860,6 +3198,11 @@ static void inverse_mdct(float *buffer, int n, vorb *f, int blocktype)
 
    // this cannot POSSIBLY be in place, so we refer to the buffers directly
 
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd)
+      imdct_step8_sse(buffer, buf2, f->B[blocktype], n);
+   else
+#endif
    {
       float *d0,*d1,*d2,*d3;
 
@@ -3165,6 +3508,38 @@ static int vorbis_decode_initial(vorb *f, int *p_left_start, int *p_left_end, in
    return TRUE;
 }
 
+#ifdef STB_VORBIS_SSE2
+// (LS) the inverse coupling below without the branches
+static void inverse_coupling_sse(float *m, float *a, int n)
+{
+   __m128 zero = _mm_setzero_ps(), sign = _mm_set1_ps(-0.0f);
+   int j;
+   for (j=0; j+4 <= n; j += 4) {
+      __m128 mv = _mm_loadu_ps(m+j), av = _mm_loadu_ps(a+j);
+      __m128 mp = _mm_cmpgt_ps(mv, zero), ap = _mm_cmpgt_ps(av, zero);
+      // m - a where m and a are on the same side of 0, m + a where not
+      __m128 t = _mm_add_ps(mv, _mm_xor_ps(av, _mm_andnot_ps(_mm_xor_ps(mp, ap), sign)));
+      _mm_storeu_ps(m+j, _mm_or_ps(_mm_and_ps(ap, mv), _mm_andnot_ps(ap, t)));
+      _mm_storeu_ps(a+j, _mm_or_ps(_mm_and_ps(ap, t), _mm_andnot_ps(ap, mv)));
+   }
+   for (; j < n; ++j) {
+      float a2,m2;
+      if (m[j] > 0)
+         if (a[j] > 0)
+            m2 = m[j], a2 = m[j] - a[j];
+         else
+            a2 = m[j], m2 = m[j] + a[j];
+      else
+         if (a[j] > 0)
+            m2 = m[j], a2 = m[j] + a[j];
+         else
+            a2 = m[j], m2 = m[j] - a[j];
+      m[j] = m2;
+      a[j] = a2;
+   }
+}
+#endif
+
 static int vorbis_decode_packet_rest(vorb *f, int *len, Mode *m, int left_start, int left_end, int right_start, int right_end, int *p_left)
 {
    Mapping *map;
@@ -3318,6 +3693,12 @@ static int vorbis_decode_packet_rest(vorb *f, int *len, Mode *m, int left_start,
       int n2 = n >> 1;
       float *m = f->channel_buffers[map->chan[i].magnitude];
       float *a = f->channel_buffers[map->chan[i].angle    ];
+#ifdef STB_VORBIS_SSE2
+      if (stb_vorbis_simd) {
+         inverse_coupling_sse(m, a, n2);
+         continue;
+      }
+#endif
       for (j=0; j < n2; ++j) {
          float a2,m2;
          if (m[j] > 0)
@@ -3440,6 +3821,22 @@ static int vorbis_decode_packet(vorb *f, int *len, int *p_left, int *p_right)
    return vorbis_decode_packet_rest(f, len, f->mode_config + mode, *p_left, left_end, *p_right, right_end, p_left);
 }
 
+#ifdef STB_VORBIS_SSE2
+// (LS) the overlap-add below; w is read backwards a vector at a time
+static void overlap_add_sse(float *dest, float *prev, float *w, int n)
+{
+   int j;
+   for (j=0; j+4 <= n; j += 4) {
+      __m128 wr = _mm_loadu_ps(w + n-4-j);
+      wr = _mm_shuffle_ps(wr, wr, _MM_SHUFFLE(0,1,2,3));
+      _mm_storeu_ps(dest+j, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(dest+j), _mm_loadu_ps(w+j)),
+                                       _mm_mul_ps(_mm_loadu_ps(prev+j), wr)));
+   }
+   for (; j < n; ++j)
+      dest[j] = dest[j]*w[j] + prev[j]*w[n-1-j];
+}
+#endif
+
 static int vorbis_finish_frame(stb_vorbis *f, int len, int left, int right)
 {
    int prev,i,j;
@@ -3457,6 +3854,12 @@ static int vorbis_finish_frame(stb_vorbis *f, int len, int left, int right)
       float *w = get_window(f, n);
       if (w == NULL) return 0;
       for (i=0; i < f->channels; ++i) {
+#ifdef STB_VORBIS_SSE2
+         if (stb_vorbis_simd) {
+            overlap_add_sse(f->channel_buffers[i] + left, f->previous_window[i], w, n);
+            continue;
+         }
+#endif
          for (j=0; j < n; ++j)
             f->channel_buffers[i][left+j] =
                f->channel_buffers[i][left+j]*w[    j] +
@@ -4722,6 +5125,22 @@ static int seek_to_sample_coarse(stb_vorbis *f, uint32 sample_number)
       return 0;
    }
 
+   // (LS) with a page index the page is found without reading the file
+   if (f->page_index_len > 0) {
+      int lo = 0, hi = f->page_index_len - 1;
+      while (lo < hi) {
+         int m = (lo + hi + 1) >> 1;
+         if (f->page_index[m].last_sample <= last_sample_limit)
+            lo = m;
+         else
+            hi = m - 1;
+      }
+      if (f->page_index[lo].last_sample <= last_sample_limit &&
+          f->page_index[lo].offset > left.page_start)
+         left.page_start = f->page_index[lo].offset;
+      goto found;
+   }
+
    while (left.page_end != right.page_start) {
       assert(left.page_end < right.page_start);
       // search range in bytes
@@ -4783,6 +5202,7 @@ static int seek_to_sample_coarse(stb_vorbis *f, uint32 sample_number)
       ++probe;
    }
 
+found:
    // seek back to start of the last packet
    page_start = left.page_start;
    set_file_offset(f, page_start);
@@ -4926,6 +5346,40 @@ int stb_vorbis_seek_start(stb_vorbis *f)
    return vorbis_pump_first_frame(f);
 }
 
+// (LS)
+int stb_vorbis_build_page_index(stb_vorbis *f, stb_vorbis_page *pages, int max_pages)
+{
+   ProbedPage p;
+   unsigned int restore_offset;
+   int n = 0;
+
+   if (IS_PUSH_MODE(f)) return error(f, VORBIS_invalid_api_mixing);
+
+   restore_offset = stb_vorbis_get_file_offset(f);
+   set_file_offset(f, f->first_audio_page_offset);
+   // the header of a page cut off at the end of the file may still be read
+   while (stb_vorbis_get_file_offset(f) < f->stream_len && get_seek_page_info(f, &p)) {
+      if (p.page_end > f->stream_len) break;
+      if (p.last_decoded_sample != ~0U) {
+         if (pages && n < max_pages) {
+            pages[n].offset = p.page_start;
+            pages[n].last_sample = p.last_decoded_sample;
+         }
+         ++n;
+      }
+      if (!set_file_offset(f, p.page_end)) break;
+   }
+   set_file_offset(f, restore_offset);
+   return n;
+}
+
+// (LS)
+void stb_vorbis_set_page_index(stb_vorbis *f, const stb_vorbis_page *pages, int num_pages)
+{
+   f->page_index = pages;
+   f->page_index_len = pages ? num_pages : 0;
+}
+
 unsigned int stb_vorbis_stream_length_in_samples(stb_vorbis *f)
 {
    unsigned int restore_offset, previous_safe;
@@ -5030,6 +5484,20 @@ int stb_vorbis_get_frame_float(stb_vorbis *f, int *channels, float ***output)
    return len;
 }
 
+int stb_vorbis_get_samples_float_pointers(stb_vorbis *f, float ***output, int num_samples)
+{
+   float **outputs;
+   int i, k;
+   while ((k = f->channel_buffer_end - f->channel_buffer_start) == 0)
+      if (!stb_vorbis_get_frame_float(f, NULL, &outputs)) return 0;
+   if (k > num_samples) k = num_samples;
+   for (i=0; i < f->channels; ++i)
+      f->outputs[i] = f->channel_buffers[i] + f->channel_buffer_start;
+   f->channel_buffer_start += k;
+   *output = f->outputs;
+   return k;
+}
+
 #ifndef STB_VORBIS_NO_STDIO
 
 stb_vorbis * stb_vorbis_open_file_section(FILE *file, int close_on_free, int *error, const stb_vorbis_alloc *alloc, unsigned int length)
@@ -5142,10 +5610,57 @@ static int8 channel_position[7][6] =
    #define FASTDEF(x)
 #endif
 
+#ifdef STB_VORBIS_SSE2
+// (LS) FAST_SCALED_FLOAT_TO_INT on four floats. packing the results to 16
+// bits saturates them the same way the scalar loops clamp
+static __forceinline __m128i float_to_int_sse(float *x)
+{
+#ifndef STB_VORBIS_NO_FAST_SCALED_FLOAT
+   __m128 t = _mm_add_ps(_mm_loadu_ps(x), _mm_set1_ps(MAGIC(15)));
+   return _mm_sub_epi32(_mm_castps_si128(t), _mm_set1_epi32(ADDEND(15)));
+#else
+   return _mm_cvttps_epi32(_mm_mul_ps(_mm_loadu_ps(x), _mm_set1_ps(1 << 15)));
+#endif
+}
+
+// (LS) 1 or 2 channels to interleaved shorts
+static void convert_short_sse(short *buffer, int channels, float **data, int d_offset, int len)
+{
+   float *l = data[0] + d_offset, *r = data[channels-1] + d_offset;
+   int i,j = 0;
+   if (channels == 1) {
+      for (; j+8 <= len; j += 8)
+         _mm_storeu_si128((__m128i *) (buffer+j), _mm_packs_epi32(float_to_int_sse(l+j), float_to_int_sse(l+j+4)));
+   } else {
+      for (; j+8 <= len; j += 8) {
+         __m128i a = _mm_packs_epi32(float_to_int_sse(l+j), float_to_int_sse(l+j+4));
+         __m128i b = _mm_packs_epi32(float_to_int_sse(r+j), float_to_int_sse(r+j+4));
+         _mm_storeu_si128((__m128i *) (buffer+j*2  ), _mm_unpacklo_epi16(a, b));
+         _mm_storeu_si128((__m128i *) (buffer+j*2+8), _mm_unpackhi_epi16(a, b));
+      }
+   }
+   for (; j < len; ++j) {
+      for (i=0; i < channels; ++i) {
+         FASTDEF(temp);
+         int v = FAST_SCALED_FLOAT_TO_INT(temp, data[i][d_offset+j],15);
+         if ((unsigned int) (v + 32768) > 65535)
+            v = v < 0 ? -32768 : 32767;
+         buffer[j*channels+i] = v;
+      }
+   }
+}
+#endif
+
 static void copy_samples(short *dest, float *src, int len)
 {
    int i;
    check_endianness();
+#ifdef STB_VORBIS_SSE2
+   if (stb_vorbis_simd) {
+      convert_short_sse(dest, 1, &src, 0, len);
+      return;
+   }
+#endif
    for (i=0; i < len; ++i) {
       FASTDEF(temp);
       int v = FAST_SCALED_FLOAT_TO_INT(temp, src[i],15);
@@ -5256,6 +5771,12 @@ static void convert_channels_short_interleaved(int buf_c, short *buffer, int dat
    } else {
       int limit = buf_c < data_c ? buf_c : data_c;
       int j;
+#ifdef STB_VORBIS_SSE2
+      if (stb_vorbis_simd && limit == buf_c && buf_c <= 2) {
+         convert_short_sse(buffer, buf_c, data, d_offset, len);
+         return;
+      }
+#endif
       for (j=0; j < len; ++j) {
          for (i=0; i < limit; ++i) {
             FASTDEF(temp);
@@ -5271,6 +5792,12 @@ static void convert_channels_short_interleaved(int buf_c, short *buffer, int dat
    }
 }
 
+// (LS)
+void stb_vorbis_convert_short_interleaved(int channels, short *buffer, float **data, int num_samples)
+{
+   convert_channels_short_interleaved(channels, buffer, channels, data, 0, num_samples);
+}
+
 int stb_vorbis_get_frame_short_interleaved(stb_vorbis *f, int num_c, short *buffer, int num_shorts)
 {
    float **output;